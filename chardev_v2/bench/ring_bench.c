@@ -0,0 +1,302 @@
+/*
+ * ring_bench.c - User space microbenchmark for the mycdev ring buffer.
+ *
+ * Copyright (C) 2011  Faisal Hassan.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Moves fixed size messages through mycdev_ring.h with one producer and
+ * one consumer (spsc), several producers (mpsc) and several of both
+ * (mpmc). Several producers or consumers share a mutex, as writers and
+ * readers of mycdev share dev_wsem and dev_rsem.
+ *
+ *	ring_bench [-w file] [-b file] [-t percent]
+ *
+ * -w writes the results as a baseline, -b compares against one and exits
+ * with 1 if any case is more than percent (default 30) slower, or is not
+ * in the baseline.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mycdev_ring.h"
+
+#define RING_SIZE	(64 * 1024)
+#define RING_BYTES	(256UL * 1024 * 1024)	/* moved per case */
+#define RUNS		5			/* best of */
+#define MAX_THREADS	8
+#define MAX_CASES	32
+
+struct bench_case {
+	const char *name;
+	int producers;
+	int consumers;
+	uint32_t msg_size;
+};
+
+static const struct bench_case cases[] = {
+	{ "spsc", 1, 1, 16 },
+	{ "spsc", 1, 1, 64 },
+	{ "spsc", 1, 1, 256 },
+	{ "spsc", 1, 1, 1024 },
+	{ "mpsc", 3, 1, 64 },
+	{ "mpsc", 3, 1, 1024 },
+	{ "mpmc", 2, 2, 64 },
+	{ "mpmc", 2, 2, 1024 },
+};
+
+#define NR_CASES	(sizeof(cases) / sizeof(cases[0]))
+
+struct bench_state {
+	struct mycdev_ring ring;
+	pthread_mutex_t wlock;		/* taken with several producers */
+	pthread_mutex_t rlock;		/* taken with several consumers */
+	const struct bench_case *bc;
+	unsigned long msgs_per_producer;
+	unsigned long msgs_total;
+	unsigned long consumed;		/* by all consumers, under rlock */
+	uint64_t checksum;		/* of the first byte of each message */
+};
+
+static void bench_relax(void)
+{
+	sched_yield();
+}
+
+static void *bench_producer(void *arg)
+{
+	struct bench_state *st = arg;
+	const struct bench_case *bc = st->bc;
+	uint8_t msg[1024];
+	unsigned long i;
+	uint32_t done;
+
+	for (i = 0; i < st->msgs_per_producer; i++) {
+		memset(msg, (int)(i & 0xff), bc->msg_size);
+		for (;;) {
+			if (bc->producers > 1)
+				pthread_mutex_lock(&st->wlock);
+			done = 0;
+			/* Messages go in whole, so consumers never see halves. */
+			if (mycdev_ring_free(&st->ring) >= bc->msg_size)
+				done = mycdev_ring_put(&st->ring, msg, bc->msg_size);
+			if (bc->producers > 1)
+				pthread_mutex_unlock(&st->wlock);
+			if (done)
+				break;
+			bench_relax();
+		}
+	}
+	return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+	struct bench_state *st = arg;
+	const struct bench_case *bc = st->bc;
+	uint8_t msg[1024];
+	uint64_t sum = 0;
+	uint32_t done;
+	int last = 0;
+
+	while (!last) {
+		if (bc->consumers > 1)
+			pthread_mutex_lock(&st->rlock);
+		if (st->consumed == st->msgs_total) {
+			last = 1;
+			done = 0;
+		} else if (mycdev_ring_used(&st->ring) >= bc->msg_size) {
+			done = mycdev_ring_get(&st->ring, msg, bc->msg_size);
+			st->consumed++;
+			last = st->consumed == st->msgs_total;
+		} else {
+			done = 0;
+		}
+		if (bc->consumers > 1)
+			pthread_mutex_unlock(&st->rlock);
+
+		if (done)
+			sum += msg[0];
+		else if (!last)
+			bench_relax();
+	}
+
+	pthread_mutex_lock(&st->rlock);
+	st->checksum += sum;
+	pthread_mutex_unlock(&st->rlock);
+	return NULL;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns messages per second, 0 on error. */
+static double bench_run(const struct bench_case *bc)
+{
+	static uint8_t buff[RING_SIZE];
+	pthread_t threads[MAX_THREADS];
+	struct bench_state st;
+	uint64_t expect = 0;
+	unsigned long i;
+	double start, elapsed;
+	int n = 0, j;
+
+	memset(&st, 0, sizeof(st));
+	mycdev_ring_init(&st.ring, buff, RING_SIZE);
+	pthread_mutex_init(&st.wlock, NULL);
+	pthread_mutex_init(&st.rlock, NULL);
+	st.bc = bc;
+	st.msgs_per_producer = RING_BYTES / bc->msg_size / bc->producers;
+	st.msgs_total = st.msgs_per_producer * bc->producers;
+
+	start = bench_now();
+	for (j = 0; j < bc->consumers; j++)
+		if (pthread_create(&threads[n++], NULL, bench_consumer, &st))
+			return 0;
+	for (j = 0; j < bc->producers; j++)
+		if (pthread_create(&threads[n++], NULL, bench_producer, &st))
+			return 0;
+	for (j = 0; j < n; j++)
+		pthread_join(threads[j], NULL);
+	elapsed = bench_now() - start;
+
+	/* Every message must come out exactly once. */
+	for (i = 0; i < st.msgs_per_producer; i++)
+		expect += i & 0xff;
+	expect *= bc->producers;
+	if (st.checksum != expect || mycdev_ring_used(&st.ring) != 0) {
+		fprintf(stderr, "%s/%u: data lost or duplicated\n",
+				bc->name, bc->msg_size);
+		return 0;
+	}
+
+	pthread_mutex_destroy(&st.wlock);
+	pthread_mutex_destroy(&st.rlock);
+	return st.msgs_total / elapsed;
+}
+
+/* Baseline lines are "name msg_size msgs_per_sec". */
+static double baseline_lookup(FILE *fp, const struct bench_case *bc)
+{
+	char name[16];
+	unsigned int size;
+	double rate;
+
+	rewind(fp);
+	while (fscanf(fp, "%15s %u %lf", name, &size, &rate) == 3)
+		if (!strcmp(name, bc->name) && size == bc->msg_size)
+			return rate;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *wfile = NULL, *bfile = NULL;
+	double tolerance = 30, results[MAX_CASES], best, rate, base;
+	FILE *fp;
+	unsigned int i;
+	int opt, run, ret = 0;
+
+	while ((opt = getopt(argc, argv, "w:b:t:")) != -1) {
+		switch (opt) {
+		case 'w':
+			wfile = optarg;
+			break;
+		case 'b':
+			bfile = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w file] [-b file] [-t percent]\n",
+					argv[0]);
+			return 2;
+		}
+	}
+
+	printf("%-6s %8s %14s %10s\n", "case", "msg_size", "msgs/s", "MB/s");
+	for (i = 0; i < NR_CASES; i++) {
+		best = 0;
+		for (run = 0; run < RUNS; run++) {
+			rate = bench_run(&cases[i]);
+			if (rate == 0)
+				return 2;
+			if (rate > best)
+				best = rate;
+		}
+		results[i] = best;
+		printf("%-6s %8u %14.0f %10.1f\n", cases[i].name,
+				cases[i].msg_size, best,
+				best * cases[i].msg_size / 1e6);
+	}
+
+	if (wfile) {
+		fp = fopen(wfile, "w");
+		if (fp == NULL) {
+			perror(wfile);
+			return 2;
+		}
+		for (i = 0; i < NR_CASES; i++)
+			fprintf(fp, "%s %u %.0f\n", cases[i].name,
+					cases[i].msg_size, results[i]);
+		fclose(fp);
+		printf("baseline written to %s\n", wfile);
+	}
+
+	if (bfile) {
+		fp = fopen(bfile, "r");
+		if (fp == NULL) {
+			perror(bfile);
+			return 2;
+		}
+		for (i = 0; i < NR_CASES; i++) {
+			base = baseline_lookup(fp, &cases[i]);
+			if (base == 0) {
+				/* a new case must not slip through unchecked */
+				printf("MISSING %s/%u: not in the baseline\n",
+						cases[i].name, cases[i].msg_size);
+				ret = 1;
+				continue;
+			}
+			if (results[i] < base * (100 - tolerance) / 100) {
+				printf("REGRESSION %s/%u: %.0f msgs/s, baseline %.0f\n",
+						cases[i].name, cases[i].msg_size,
+						results[i], base);
+				ret = 1;
+			}
+		}
+		fclose(fp);
+		if (ret == 0)
+			printf("within %.0f%% of %s\n", tolerance, bfile);
+	}
+
+	return ret;
+}
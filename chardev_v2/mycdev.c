@@ -25,18 +25,30 @@
 #include <linux/fs.h>		/* Required for various structures related to files liked fops. */
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/slab.h>	/* Required for kmalloc_node() */
+#include <linux/gfp.h>		/* Required for alloc_pages_node() */
+#include <linux/mm.h>
+#include <linux/log2.h>	/* Required for roundup_pow_of_two() */
 #include <linux/timer.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>	/* Required for the wakeup deadline */
 #include <linux/wait.h>		/* Required for the wait queues */
 #include <linux/sched.h>	/* Required for task states (TASK_INTERRUPTIBLE etc ) */
+#include <linux/poll.h>		/* Required for poll_wait() */
 #include <asm/uaccess.h>	/* Required for copy_from and copy_to user functions */
 
 #include "debug.h"
 #include "mycdev.h" /* TODO Should move to <linux/mycdev.h> */
+#include "mycdev_ring.h"
 
 #define SEC 25
 #define MYCDEV_LEN 1024
 #define MYCDEV_MAX_MINOR 1
 
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE (-1)
+#endif
+
 #define DEVICE "mycdev"
 #define DRV_DESC "Simple chardev for learning"
 #define DRV_VERSION "1.0"
@@ -44,29 +56,170 @@
 /* my device structure */
 struct mycdev {
 	uint8_t *dev_rbuff; /* device read buffer, provide data to read system call */
-	uint8_t *dev_wbuff; /* device write buffer, get data from write system call */
-	uint32_t dev_size; /* size of the device buffer */
-	uint32_t dev_rindex; /* index of read buffer */
+	uint32_t dev_size; /* most bytes taken by one write */
+	uint32_t dev_bufsize; /* allocated size of dev_rbuff */
+	int dev_node; /* NUMA node holding the device and its buffer */
+	struct mycdev_ring dev_ring; /* FIFO of written data, in dev_rbuff */
 	char dev_flag;
+	spinlock_t dev_lock; /* dev_flag against the timers and the other side */
 	struct cdev dev_cdev;
 	struct semaphore dev_rsem;
 	struct semaphore dev_wsem;
 	struct timer_list dev_timer;
+	struct hrtimer dev_hrtimer; /* wakeup deadline of a write burst */
+	struct mycdev_wakeup dev_wakeup; /* reader wakeup policy */
 	wait_queue_head_t dev_rqueue;
+	wait_queue_head_t dev_wqueue; /* writers waiting for space */
+	struct fasync_struct *dev_async; /* SIGIO subscribers */
 };
 
 static int Major = 0;
 
+static int node = NUMA_NO_NODE;
+module_param(node, int, 0444);
+MODULE_PARM_DESC(node, " NUMA node for the device buffer, -1 for the loading CPU's node");
+
+static unsigned int bufsize = MYCDEV_LEN;
+module_param(bufsize, uint, 0444);
+MODULE_PARM_DESC(bufsize, " Size of the device buffer in bytes, rounded up to a power of 2");
+
+static unsigned int wake_policy = MYCDEV_WAKE_TIMER;
+module_param(wake_policy, uint, 0444);
+MODULE_PARM_DESC(wake_policy, " Reader wakeup policy, MYCDEV_WAKE_* in mycdev.h");
+
+static unsigned int low_wmark = MYCDEV_LEN / 2;
+module_param(low_wmark, uint, 0444);
+MODULE_PARM_DESC(low_wmark, " Buffered bytes that wake readers (watermark policy)");
+
+static unsigned int max_latency_us = 1000;
+module_param(max_latency_us, uint, 0444);
+MODULE_PARM_DESC(max_latency_us, " Longest a write waits for its reader wakeup");
+
+/*
+ * Wake the readers, unless an earlier wakeup is still pending for them:
+ * they will see this data too.
+ */
+static void mycdev_wake(struct mycdev *mycdevp)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mycdevp->dev_lock, flags);
+	if (mycdevp->dev_flag == 'y') {
+		spin_unlock_irqrestore(&mycdevp->dev_lock, flags);
+		return;
+	}
+	mycdevp->dev_flag = 'y';
+	spin_unlock_irqrestore(&mycdevp->dev_lock, flags);
+
+	wake_up_interruptible(&mycdevp->dev_rqueue);
+	kill_fasync(&mycdevp->dev_async, SIGIO, POLL_IN);
+}
+
+/* The reader wakeup fired and there is something to read. */
+static int mycdev_readable(struct mycdev *mycdevp)
+{
+	return mycdevp->dev_flag != 'n' &&
+		mycdev_ring_used(&mycdevp->dev_ring) != 0;
+}
+
 static void mycdev_timer(unsigned long data)
 {
 	struct mycdev *mycdevp = (struct mycdev *)data;
 
 	entry_info();
-	mycdevp->dev_flag = 'y';
-	wake_up_interruptible(&mycdevp->dev_rqueue);
+	mycdev_wake(mycdevp);
 	exit_info();
 }
 
+static enum hrtimer_restart mycdev_deadline(struct hrtimer *timer)
+{
+	struct mycdev *mycdevp = container_of(timer, struct mycdev, dev_hrtimer);
+
+	mycdev_wake(mycdevp);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Called after every write. Only the first write of a burst arms the
+ * deadline, the ones that follow ride on it, so a burst of small writes
+ * costs the readers a single wakeup.
+ */
+static void mycdev_data_ready(struct mycdev *mycdevp)
+{
+	struct mycdev_wakeup *wakeup = &mycdevp->dev_wakeup;
+	unsigned long flags;
+
+	switch (wakeup->policy) {
+	case MYCDEV_WAKE_IMMEDIATE:
+		mycdev_wake(mycdevp);
+		break;
+	case MYCDEV_WAKE_WATERMARK:
+		if (mycdev_ring_used(&mycdevp->dev_ring) >= wakeup->low_wmark) {
+			hrtimer_try_to_cancel(&mycdevp->dev_hrtimer);
+			mycdev_wake(mycdevp);
+			break;
+		}
+		/* fall through */
+	case MYCDEV_WAKE_DEADLINE:
+		/* under dev_lock, or a reader clearing dev_flag races with us */
+		spin_lock_irqsave(&mycdevp->dev_lock, flags);
+		if (mycdevp->dev_flag == 'n' &&
+				!hrtimer_active(&mycdevp->dev_hrtimer))
+			hrtimer_start(&mycdevp->dev_hrtimer,
+					ns_to_ktime((u64)wakeup->max_latency_us *
+						NSEC_PER_USEC),
+					HRTIMER_MODE_REL);
+		spin_unlock_irqrestore(&mycdevp->dev_lock, flags);
+		break;
+	default: /* MYCDEV_WAKE_TIMER */
+		/* once the load timer fired, readers only wait for data */
+		if (mycdevp->dev_flag != 'n') {
+			wake_up_interruptible(&mycdevp->dev_rqueue);
+			kill_fasync(&mycdevp->dev_async, SIGIO, POLL_IN);
+		}
+		break;
+	}
+}
+
+static int mycdev_set_wakeup(struct mycdev *mycdevp,
+		struct mycdev_wakeup *wakeup)
+{
+	unsigned long flags;
+	uint32_t used;
+	int wake;
+
+	if (wakeup->policy > MYCDEV_WAKE_DEADLINE)
+		return -EINVAL;
+
+	/* The load time timer only serves the timer policy. */
+	if (wakeup->policy != MYCDEV_WAKE_TIMER)
+		del_timer_sync(&mycdevp->dev_timer);
+	hrtimer_cancel(&mycdevp->dev_hrtimer);
+
+	/*
+	 * Restart dev_flag for the new policy, a wakeup owed under the old
+	 * one must not be lost. Timer set at run time acts as if the load
+	 * timer already fired: every write wakes the readers.
+	 */
+	spin_lock_irqsave(&mycdevp->dev_lock, flags);
+	mycdevp->dev_wakeup = *wakeup;
+	used = mycdev_ring_used(&mycdevp->dev_ring);
+	if (wakeup->policy == MYCDEV_WAKE_TIMER) {
+		if (!timer_pending(&mycdevp->dev_timer))
+			mycdevp->dev_flag = 'y';
+	} else {
+		mycdevp->dev_flag = used ? 'y' : 'n';
+	}
+	wake = mycdevp->dev_flag != 'n' && used != 0;
+	spin_unlock_irqrestore(&mycdevp->dev_lock, flags);
+
+	if (wake) {
+		wake_up_interruptible(&mycdevp->dev_rqueue);
+		kill_fasync(&mycdevp->dev_async, SIGIO, POLL_IN);
+	}
+	return 0;
+}
+
 static int mycdev_open(struct inode *inode, struct file *file)
 {
 	/* look up device info for this device file */
@@ -77,17 +230,28 @@ static int mycdev_open(struct inode *inode, struct file *file)
 	kobject_get(&mycdevp->dev_cdev.kobj); /* try_module_get? */
 
 	/* Mark the flag as 'do not read' */
+	spin_lock_irq(&mycdevp->dev_lock);
 	mycdevp->dev_flag = 'n';
+	spin_unlock_irq(&mycdevp->dev_lock);
 
 	exit_info();
 	return 0;
 }
 
+static int mycdev_fasync(int fd, struct file *file, int mode)
+{
+	struct mycdev *mycdevp = (struct mycdev *)file->private_data;
+
+	return fasync_helper(fd, file, mode, &mycdevp->dev_async);
+}
+
 static int mycdev_close(struct inode *inode, struct file *file)
 {
 	struct mycdev *mycdevp = (struct mycdev *)file->private_data;
 
 	entry_info();
+	/* remove this file from the asynchronously notified files */
+	mycdev_fasync(-1, file, 0);
 	kobject_put(&mycdevp->dev_cdev.kobj); /* try_module_put? */
 	exit_info();
 
@@ -99,6 +263,8 @@ static ssize_t mycdev_read(struct file *file, char __user *ubuff,
 {
 	ssize_t ret = 0;
 	struct mycdev *mycdevp = (struct mycdev *)file->private_data;
+	unsigned long flags;
+	int rewake = 0;
 
 	entry_info();
 	info("Try to get read lock");
@@ -119,31 +285,68 @@ static ssize_t mycdev_read(struct file *file, char __user *ubuff,
 	}
 
 	info("Got read lock");
-	wait_event_interruptible(mycdevp->dev_rqueue, mycdevp->dev_flag != 'n');
-	info("In read wait Q");
-
-	if (*offset >= mycdevp->dev_rindex) {
-		info("EOF");
-		goto out;
+	while (!mycdev_readable(mycdevp)) {
+		/* nothing to read yet, release the lock before sleeping */
+		up(&mycdevp->dev_rsem);
+		if (file->f_flags & O_NONBLOCK) {
+			info("O_NONBLOCK specified : no data");
+			return -EAGAIN;
+		}
+		info("In read wait Q");
+		if (wait_event_interruptible(mycdevp->dev_rqueue,
+					mycdev_readable(mycdevp)))
+			return -ERESTARTSYS; /* signal: let the fs layer handle it */
+		/* otherwise loop, but first reacquire the lock */
+		if (down_interruptible(&mycdevp->dev_rsem))
+			return -ERESTARTSYS;
 	}
 
-	if ((*offset + count) >= mycdevp->dev_rindex)
-		count = mycdevp->dev_rindex - *offset;
-
-	if (copy_to_user(ubuff, mycdevp->dev_rbuff + *offset, count)) {
-		ret = -EFAULT;
-		goto out;
+	/* Copy out what is buffered, in at most two pieces if it wraps. */
+	while (ret < count) {
+		uint8_t *p;
+		uint32_t len = mycdev_ring_read_span(&mycdevp->dev_ring, &p);
+
+		if (len == 0)
+			break;
+		if (len > count - ret)
+			len = count - ret;
+		if (copy_to_user(ubuff + ret, p, len)) {
+			if (ret == 0) {
+				ret = -EFAULT;
+				goto out;
+			}
+			break; /* report what was copied */
+		}
+		mycdev_ring_consume(&mycdevp->dev_ring, len);
+		ret += len;
 	}
 
-	ret = count;
 	*offset += ret;
+	/*
+	 * All read, the next write has to wake us up again. The test and the
+	 * clear are one step for writers, see mycdev_wake(). Data left over,
+	 * or written since a writer found dev_flag set, is for other readers.
+	 */
+	spin_lock_irqsave(&mycdevp->dev_lock, flags);
+	if (mycdev_ring_used(&mycdevp->dev_ring) == 0) {
+		if (mycdevp->dev_wakeup.policy != MYCDEV_WAKE_TIMER)
+			mycdevp->dev_flag = 'n';
+	} else if (mycdevp->dev_flag != 'n') {
+		rewake = 1;
+	}
+	spin_unlock_irqrestore(&mycdevp->dev_lock, flags);
+	if (rewake)
+		wake_up_interruptible(&mycdevp->dev_rqueue);
+	/* there is room again for writers */
+	if (ret > 0)
+		wake_up_interruptible(&mycdevp->dev_wqueue);
 out:
 	/* release the read buffer and wake anyone who might be
 	 * waiting for it
 	 */
 	up(&mycdevp->dev_rsem);
 	info("*offset     : %lli", *offset);
-	info("dev_rindex  : %u", mycdevp->dev_rindex);
+	info("buffered    : %u", mycdev_ring_used(&mycdevp->dev_ring));
 	info("count       : %li", count);
 	exit_info();
 	/* return the number of characters read in */
@@ -176,20 +379,48 @@ static ssize_t mycdev_write(struct file *file, const char __user *ubuff,
 	}
 
 	info("Got write lock");
-	if (count > mycdevp->dev_size)
-		count = mycdevp->dev_size - 1;
+	while (mycdev_ring_free(&mycdevp->dev_ring) == 0) {
+		/* full, release the lock before waiting for a reader */
+		up(&mycdevp->dev_wsem);
+		if (file->f_flags & O_NONBLOCK) {
+			info("O_NONBLOCK specified : no space");
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(mycdevp->dev_wqueue,
+					mycdev_ring_free(&mycdevp->dev_ring) != 0))
+			return -ERESTARTSYS;
+		if (down_interruptible(&mycdevp->dev_wsem))
+			return -ERESTARTSYS;
+	}
 
-	ret = count;
-	if (copy_from_user(mycdevp->dev_rbuff, ubuff, count)) {
-		ret = -EFAULT;
-		goto out;
+	if (count > mycdevp->dev_size)
+		count = mycdevp->dev_size;
+
+	/* Copy in what fits, in at most two pieces if it wraps. */
+	ret = 0;
+	while (ret < count) {
+		uint8_t *p;
+		uint32_t len = mycdev_ring_write_span(&mycdevp->dev_ring, &p);
+
+		if (len == 0)
+			break;
+		if (len > count - ret)
+			len = count - ret;
+		if (copy_from_user(p, ubuff + ret, len)) {
+			if (ret == 0) {
+				ret = -EFAULT;
+				goto out;
+			}
+			break; /* report what was copied */
+		}
+		mycdev_ring_produce(&mycdevp->dev_ring, len);
+		ret += len;
 	}
 
-	mycdevp->dev_rbuff[count] = '\0';
-	mycdevp->dev_rindex = count;
-	info("count      : %li", count);
+	mycdev_data_ready(mycdevp);
+	info("count      : %li", ret);
 	info("dev_size   : %u", mycdevp->dev_size);
-	info("dev_rindex : %u", mycdevp->dev_rindex);
+	info("buffered   : %u", mycdev_ring_used(&mycdevp->dev_ring));
 out:
 	/* release the write buffer and wake anyone who's waiting for it */
 	up(&mycdevp->dev_wsem);
@@ -197,6 +428,25 @@ out:
 	return ret;
 }
 
+/*
+ * Readable once the reader wakeup fired and while the ring holds data,
+ * writable while it has room.
+ */
+static unsigned int mycdev_poll(struct file *file, poll_table *wait)
+{
+	struct mycdev *mycdevp = (struct mycdev *)file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &mycdevp->dev_rqueue, wait);
+	poll_wait(file, &mycdevp->dev_wqueue, wait);
+	if (mycdev_readable(mycdevp))
+		mask |= POLLIN | POLLRDNORM;
+	if (mycdev_ring_free(&mycdevp->dev_ring) != 0)
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
 static loff_t mycdev_llseek(struct file *file, loff_t position, int whence)
 {
 	entry_info();
@@ -212,6 +462,7 @@ static int mycdev_ioctl(struct inode *inode, struct file *file,
 {
 	struct mycdev_ctl *ctlp = (struct mycdev_ctl *)arg;
 	struct mycdev *mycdevp = (struct mycdev *)file->private_data;
+	struct mycdev_wakeup wakeup;
 	int ret = 0;
 
 	entry_info();
@@ -225,17 +476,52 @@ static int mycdev_ioctl(struct inode *inode, struct file *file,
 	case MYCDEV_G_DATA:
 		info("MYCDEV_G_DATA");
 		ctlp->dev_size = mycdevp->dev_size;
-		ctlp->dev_rindex = mycdevp->dev_rindex;
+		ctlp->dev_rindex = mycdev_ring_used(&mycdevp->dev_ring);
 		break;
 	case MYCDEV_S_DATA:
 		info("MYCDEV_S_DATA");
+		/* only the write size limit can be set, dev_rindex is ignored */
+		if (ctlp->dev_size == 0 || ctlp->dev_size > mycdevp->dev_bufsize) {
+			ret = -EINVAL;
+			goto out;
+		}
 		mycdevp->dev_size = ctlp->dev_size;
-		mycdevp->dev_rindex = ctlp->dev_rindex;
 		break;
 	case MYCDEV_FLUSH:
-		mycdevp->dev_rindex = 0;
-		mycdevp->dev_size = MYCDEV_LEN;
-		mycdevp->dev_rbuff[0] = '\0';
+		/* the ring may only be reset with no reader or writer in it */
+		if (down_interruptible(&mycdevp->dev_wsem)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		if (down_interruptible(&mycdevp->dev_rsem)) {
+			up(&mycdevp->dev_wsem);
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		mycdev_ring_reset(&mycdevp->dev_ring);
+		mycdevp->dev_size = mycdevp->dev_bufsize;
+		/* empty now, the next write has to wake the readers again */
+		spin_lock_irq(&mycdevp->dev_lock);
+		if (mycdevp->dev_wakeup.policy != MYCDEV_WAKE_TIMER)
+			mycdevp->dev_flag = 'n';
+		spin_unlock_irq(&mycdevp->dev_lock);
+		up(&mycdevp->dev_rsem);
+		up(&mycdevp->dev_wsem);
+		wake_up_interruptible(&mycdevp->dev_wqueue);
+		break;
+	case MYCDEV_G_WAKEUP:
+		info("MYCDEV_G_WAKEUP");
+		if (copy_to_user((void __user *)arg, &mycdevp->dev_wakeup,
+					sizeof(wakeup)))
+			ret = -EFAULT;
+		break;
+	case MYCDEV_S_WAKEUP:
+		info("MYCDEV_S_WAKEUP");
+		if (copy_from_user(&wakeup, (void __user *)arg, sizeof(wakeup))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = mycdev_set_wakeup(mycdevp, &wakeup);
 		break;
 	default:
 		err("Invalid ioctl command");
@@ -254,11 +540,39 @@ static struct file_operations fops = {
 	.read = mycdev_read,
 	.write = mycdev_write,
 	.llseek = mycdev_llseek,
+	.poll = mycdev_poll,
+	.fasync = mycdev_fasync,
 	.ioctl = mycdev_ioctl
 };
 static struct mycdev *mycdevp;
 static struct class *dev_class;
 
+/*
+ * Buffers of a page or more come from the page allocator as one block of
+ * physically contiguous pages on the device's node. Smaller ones come from
+ * the node's slab.
+ */
+static uint8_t *mycdev_alloc_buff(size_t size, int nid)
+{
+	struct page *page;
+
+	if (size < PAGE_SIZE)
+		return kmalloc_node(size, GFP_KERNEL, nid);
+
+	page = alloc_pages_node(nid, GFP_KERNEL | __GFP_COMP, get_order(size));
+	if (NULL == page)
+		return NULL;
+	return page_address(page);
+}
+
+static void mycdev_free_buff(uint8_t *buff, size_t size)
+{
+	if (size < PAGE_SIZE)
+		kfree(buff);
+	else if (buff)
+		free_pages((unsigned long)buff, get_order(size));
+}
+
 static int __init mycdev_init(void)
 {
 	int ret;
@@ -273,8 +587,21 @@ static int __init mycdev_init(void)
 	}
 
 	Major = MAJOR(devno);
-	/* Allocate memory */
-	mycdevp = kmalloc(sizeof(struct mycdev), GFP_KERNEL);
+	if (node != NUMA_NO_NODE && (node < 0 || node >= MAX_NUMNODES ||
+				!node_online(node))) {
+		err("NUMA node %d is not online", node);
+		ret = -EINVAL;
+		goto unregister_chrdev;
+	}
+	/* the largest block the page allocator hands out */
+	if (bufsize < 2 || bufsize > (PAGE_SIZE << (MAX_ORDER - 1))) {
+		err("bufsize %u out of range", bufsize);
+		ret = -EINVAL;
+		goto unregister_chrdev;
+	}
+
+	/* Allocate memory, next to the CPUs that will use it */
+	mycdevp = kmalloc_node(sizeof(struct mycdev), GFP_KERNEL, node);
 	if (NULL == mycdevp) {
 		err("Couldn't allocate memory for %s", DEVICE);
 		return -ENOMEM;
@@ -299,40 +626,50 @@ static int __init mycdev_init(void)
 	}
 
 	/* Allocate memory for device read buffer */
-	mycdevp->dev_size = MYCDEV_LEN;
-	mycdevp->dev_rindex = 0;
-	mycdevp->dev_rbuff = kmalloc(mycdevp->dev_size, GFP_KERNEL);
+	mycdevp->dev_node = node;
+	/* the ring indexes wrap by masking, so a power of 2 */
+	mycdevp->dev_bufsize = roundup_pow_of_two(bufsize);
+	mycdevp->dev_size = mycdevp->dev_bufsize;
+	mycdevp->dev_rbuff = mycdev_alloc_buff(mycdevp->dev_bufsize,
+			mycdevp->dev_node);
 	if (NULL == mycdevp->dev_rbuff) {
 		err("Couldn't allocate read buffer for device");
 		ret = -ENOMEM;
 		goto destroy_device_class;
 	}
-
-	/* Allocate write memory for device */
-	mycdevp->dev_wbuff = kmalloc(mycdevp->dev_size, GFP_KERNEL);
-	if (NULL == mycdevp->dev_wbuff) {
-		err("Couldn't allocate write buffer for device");
-		ret = -ENOMEM;
-		kfree(mycdevp->dev_rbuff);
-		goto destroy_device_class;
-	}
+	mycdev_ring_init(&mycdevp->dev_ring, mycdevp->dev_rbuff,
+			mycdevp->dev_bufsize);
 
 	/* Creates a device and add to sysfs */
 	device_create(dev_class, NULL, devno, NULL, "%s", DEVICE);
 	/* Initialize semaphore with count 1 */
 	sema_init(&mycdevp->dev_rsem, 1);
 	sema_init(&mycdevp->dev_wsem, 1);
+	spin_lock_init(&mycdevp->dev_lock);
 
 	init_waitqueue_head(&mycdevp->dev_rqueue);
+	init_waitqueue_head(&mycdevp->dev_wqueue);
 	mycdevp->dev_flag = 'n';
+	/* Reader wakeup policy, see mycdev_data_ready() */
+	hrtimer_init(&mycdevp->dev_hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mycdevp->dev_hrtimer.function = mycdev_deadline;
+	mycdevp->dev_wakeup.policy = wake_policy;
+	mycdevp->dev_wakeup.low_wmark = low_wmark;
+	mycdevp->dev_wakeup.max_latency_us = max_latency_us;
+	if (mycdevp->dev_wakeup.policy > MYCDEV_WAKE_DEADLINE) {
+		err("Invalid wake_policy %u, using timer", wake_policy);
+		mycdevp->dev_wakeup.policy = MYCDEV_WAKE_TIMER;
+	}
 	/* Timer */
 	setup_timer(&mycdevp->dev_timer, mycdev_timer, (unsigned long)mycdevp);
-	ret = mod_timer(&mycdevp->dev_timer, jiffies + HZ * SEC);
-	if (ret) {
-		err("mod_timer() returned");
-		goto destroy_device_class;
+	if (mycdevp->dev_wakeup.policy == MYCDEV_WAKE_TIMER) {
+		ret = mod_timer(&mycdevp->dev_timer, jiffies + HZ * SEC);
+		if (ret) {
+			err("mod_timer() returned");
+			goto destroy_device_class;
+		}
+		info("Timer added");
 	}
-	info("Timer added");
 
 	exit_info();
 	return 0;
@@ -356,9 +693,9 @@ static void __exit mycdev_exit(void)
 	/* In reverse order of removal */
 	if (del_timer(&mycdevp->dev_timer))
 		err("timer still in use");
+	hrtimer_cancel(&mycdevp->dev_hrtimer);
 
-	kfree(mycdevp->dev_rbuff);
-	kfree(mycdevp->dev_wbuff);
+	mycdev_free_buff(mycdevp->dev_rbuff, mycdevp->dev_bufsize);
 	cdev_del(&mycdevp->dev_cdev);
 	device_destroy(dev_class, devno);
 	class_destroy(dev_class);
@@ -32,5 +32,19 @@ struct mycdev_ctl {
 #define MYCDEV_G_DATA _IOR(MYCDEV_MAGIC, 0, struct mycdev_ctl)
 #define MYCDEV_S_DATA _IOW(MYCDEV_MAGIC, 1, struct mycdev_ctl)
 #define MYCDEV_FLUSH  _IOW(MYCDEV_MAGIC, 2, struct mycdev_ctl)
+#define MYCDEV_G_WAKEUP _IOR(MYCDEV_MAGIC, 3, struct mycdev_wakeup)
+#define MYCDEV_S_WAKEUP _IOW(MYCDEV_MAGIC, 4, struct mycdev_wakeup)
+
+/* When readers are woken up after a write */
+#define MYCDEV_WAKE_TIMER	0 /* by the timer SEC seconds after load, then on every write */
+#define MYCDEV_WAKE_IMMEDIATE	1 /* on every write */
+#define MYCDEV_WAKE_WATERMARK	2 /* at low_wmark bytes, or after max_latency_us */
+#define MYCDEV_WAKE_DEADLINE	3 /* max_latency_us after the first write */
+
+struct mycdev_wakeup {
+	unsigned int policy;
+	unsigned int low_wmark; /* bytes */
+	unsigned int max_latency_us;
+};
 
 #endif /* _MYCDEV_H */
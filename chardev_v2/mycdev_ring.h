@@ -0,0 +1,174 @@
+/*
+ * mycdev_ring.h - Byte ring buffer behind mycdev.
+ *
+ * Copyright (C) 2011  Faisal Hassan.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Header only, builds in the kernel and in user space (see bench/).
+ *
+ * One producer and one consumer may use a ring at the same time without
+ * a lock: the producer only moves head, the consumer only moves tail.
+ * Several producers, or several consumers, must serialize among
+ * themselves; mycdev does it with dev_wsem and dev_rsem.
+ *
+ * head and tail run freely and wrap at 2^32, size must be a power of 2.
+ */
+
+#ifndef _MYCDEV_RING_H
+#define _MYCDEV_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/compiler.h>
+#include <asm/system.h>		/* smp_mb() */
+
+/* Read the other side's index before touching the data it covers... */
+#define mycdev_ring_acquire(p)	({ typeof(*(p)) __v = ACCESS_ONCE(*(p)); \
+				   smp_mb(); __v; })
+/* ...and finish with the data before publishing our own index. */
+#define mycdev_ring_release(p, v)	do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#else
+#include <stdint.h>
+#include <string.h>
+
+#define mycdev_ring_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define mycdev_ring_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+struct mycdev_ring {
+	uint8_t *buff;
+	uint32_t size; /* power of 2 */
+	uint32_t head; /* next byte to write, owned by the producer */
+	uint32_t tail; /* next byte to read, owned by the consumer */
+};
+
+static inline void mycdev_ring_init(struct mycdev_ring *ring,
+		uint8_t *buff, uint32_t size)
+{
+	ring->buff = buff;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/* Only safe with no producer or consumer running. */
+static inline void mycdev_ring_reset(struct mycdev_ring *ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/* Bytes buffered; exact for the consumer, a lower bound for others. */
+static inline uint32_t mycdev_ring_used(struct mycdev_ring *ring)
+{
+	return mycdev_ring_acquire(&ring->head) - mycdev_ring_acquire(&ring->tail);
+}
+
+static inline uint32_t mycdev_ring_free(struct mycdev_ring *ring)
+{
+	return ring->size - mycdev_ring_used(ring);
+}
+
+/*
+ * Producer: *p is set to the contiguous free space at head, its length is
+ * returned. Fill it, then mycdev_ring_produce() what was written.
+ */
+static inline uint32_t mycdev_ring_write_span(struct mycdev_ring *ring,
+		uint8_t **p)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = mycdev_ring_acquire(&ring->tail);
+	uint32_t off = head & (ring->size - 1);
+	uint32_t len = ring->size - (head - tail);
+
+	if (len > ring->size - off)
+		len = ring->size - off;
+	*p = ring->buff + off;
+	return len;
+}
+
+static inline void mycdev_ring_produce(struct mycdev_ring *ring, uint32_t len)
+{
+	mycdev_ring_release(&ring->head, ring->head + len);
+}
+
+/* Consumer: the same for the contiguous data at tail. */
+static inline uint32_t mycdev_ring_read_span(struct mycdev_ring *ring,
+		uint8_t **p)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = mycdev_ring_acquire(&ring->head);
+	uint32_t off = tail & (ring->size - 1);
+	uint32_t len = head - tail;
+
+	if (len > ring->size - off)
+		len = ring->size - off;
+	*p = ring->buff + off;
+	return len;
+}
+
+static inline void mycdev_ring_consume(struct mycdev_ring *ring, uint32_t len)
+{
+	mycdev_ring_release(&ring->tail, ring->tail + len);
+}
+
+/* Copy in as much of src as fits, return the bytes copied. */
+static inline uint32_t mycdev_ring_put(struct mycdev_ring *ring,
+		const void *src, uint32_t len)
+{
+	uint32_t head = ring->head;
+	uint32_t free = ring->size - (head - mycdev_ring_acquire(&ring->tail));
+	uint32_t off = head & (ring->size - 1);
+	uint32_t n;
+
+	if (len > free)
+		len = free;
+	n = ring->size - off;
+	if (n > len)
+		n = len;
+
+	/* both halves of a wrapped copy, then publish once */
+	memcpy(ring->buff + off, src, n);
+	memcpy(ring->buff, (const uint8_t *)src + n, len - n);
+	mycdev_ring_release(&ring->head, head + len);
+	return len;
+}
+
+/* Copy out up to len buffered bytes, return the bytes copied. */
+static inline uint32_t mycdev_ring_get(struct mycdev_ring *ring,
+		void *dst, uint32_t len)
+{
+	uint32_t tail = ring->tail;
+	uint32_t used = mycdev_ring_acquire(&ring->head) - tail;
+	uint32_t off = tail & (ring->size - 1);
+	uint32_t n;
+
+	if (len > used)
+		len = used;
+	n = ring->size - off;
+	if (n > len)
+		n = len;
+
+	memcpy(dst, ring->buff + off, n);
+	memcpy((uint8_t *)dst + n, ring->buff, len - n);
+	mycdev_ring_release(&ring->tail, tail + len);
+	return len;
+}
+
+#endif /* _MYCDEV_RING_H */
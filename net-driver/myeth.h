@@ -0,0 +1,214 @@
+/*
+ * myeth.h - Definitions shared with user space for my ethernet driver.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#ifndef _MYETH_H
+#define _MYETH_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* rtnetlink kind, as in "ip link add type myeth" */
+#define MYETH_KIND	"myeth"
+
+/*
+ * IFLA_INFO_DATA attributes of a myeth link. MYETH_INFO_PEER nests a
+ * struct ifinfomsg followed by the IFLA_* attributes of the peer, the same
+ * layout veth uses, so existing veth netlink code can be reused.
+ */
+enum {
+	MYETH_INFO_UNSPEC,
+	MYETH_INFO_PEER,
+	__MYETH_INFO_MAX
+#define MYETH_INFO_MAX	(__MYETH_INFO_MAX - 1)
+};
+
+/*
+ * Benchmark frames are UDP/IPv4 and start their payload with this header.
+ * tstamp is the sender's monotonic clock in ns, taken when the frame was
+ * built, so it is only meaningful to a receiver on the same host.
+ */
+#define MYETH_BENCH_MAGIC	0x6d796562	/* "myeb" */
+
+struct myeth_bench_hdr {
+	__be32 magic;
+	__be32 seq;
+	__u64 tstamp;
+};
+
+/*
+ * TAP endpoint, /dev/myethtap. MYETH_TAP_ATTACH binds an open file to a
+ * myeth interface: frames the stack transmits on the interface are then
+ * queued for the file instead of going to the peer, and frames the file
+ * sends are received on the interface as if they came off the wire.
+ *
+ * read() and write() move batches of records, each a struct
+ * myeth_tap_frame followed by the frame; the next record starts at the
+ * following MYETH_TAP_ALIGN() boundary. read() returns as many queued
+ * frames as fit, write() sends every frame of the batch. Like a wire,
+ * the interface drops frames its RX ring has no room for; write() and
+ * MYETH_TAP_KICK still consume them, the drops show in rx_missed_errors.
+ *
+ * mmap() of MYETH_TAP_MMAP_SIZE bytes at offset 0 maps the same queues as
+ * two rings of MYETH_TAP_SLOTS slots, the RX ring (frames for user space)
+ * followed by the TX ring (frames from user space). Each slot starts with
+ * a struct myeth_tap_slot. Both rings are used in slot order; an RX slot
+ * belongs to user space while its status is MYETH_TAP_READY, a TX slot
+ * while it is MYETH_TAP_FREE. Set status after len and the frame, and send
+ * filled TX slots with MYETH_TAP_KICK. poll() reports POLLIN when the
+ * RX ring holds a frame.
+ */
+#define MYETH_TAP_SLOT_SIZE	2048
+#define MYETH_TAP_SLOTS		256	/* per ring, power of 2 */
+#define MYETH_TAP_RING_SIZE	(MYETH_TAP_SLOT_SIZE * MYETH_TAP_SLOTS)
+#define MYETH_TAP_MMAP_SIZE	(2 * MYETH_TAP_RING_SIZE)
+
+#define MYETH_TAP_FREE		0
+#define MYETH_TAP_READY		1
+
+struct myeth_tap_slot {
+	__u32 status;
+	__u32 len;		/* frame length, the frame follows */
+};
+
+#define MYETH_TAP_MAX_FRAME	(MYETH_TAP_SLOT_SIZE - sizeof(struct myeth_tap_slot))
+
+struct myeth_tap_frame {
+	__u32 len;		/* frame length, the frame follows */
+};
+
+#define MYETH_TAP_ALIGN(len)	(((len) + 3) & ~3U)
+
+struct myeth_tap_attach {
+	char ifname[16];	/* IFNAMSIZ */
+};
+
+#define MYETH_TAP_MAGIC		'E'
+#define MYETH_TAP_ATTACH	_IOW(MYETH_TAP_MAGIC, 0, struct myeth_tap_attach)
+#define MYETH_TAP_KICK		_IO(MYETH_TAP_MAGIC, 1)	/* returns frames sent */
+
+#ifdef __KERNEL__
+
+#include <linux/netdevice.h>
+#include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/net_tstamp.h>
+
+/*
+ * Emulated NIC. Each interface has a TX and an RX descriptor ring; writing
+ * the TX doorbell makes the "hardware" copy the posted frames into buffers
+ * posted on the peer's RX ring and raise an "interrupt", i.e. schedule NAPI
+ * on both ends.
+ */
+#define MYETH_RING_SIZE		256	/* descriptors, power of 2 */
+#define MYETH_RING_MASK		(MYETH_RING_SIZE - 1)
+#define MYETH_TX_WAKE		(MYETH_RING_SIZE / 4) /* free slots to wake */
+#define MYETH_NAPI_WEIGHT	64
+
+#define MYETH_DESC_OWN		0x0001	/* owned by the hardware */
+#define MYETH_DESC_DONE		0x0002	/* written back by the hardware */
+#define MYETH_DESC_TSTAMP	0x0004	/* tstamp holds the wire time */
+
+struct myeth_desc {
+	u64 addr;		/* buffer address, as seen by the hardware */
+	u16 len;		/* TX: frame length, RX: buffer, then frame length */
+	u16 flags;
+	u32 reserved;
+	u64 tstamp;		/* written back: device clock, ns */
+};
+
+struct myeth_ring {
+	struct myeth_desc *desc;	/* shared with the hardware */
+	struct sk_buff **skb;		/* buffer behind each descriptor */
+	unsigned int prod;		/* next descriptor the driver posts */
+	unsigned int cons;		/* next descriptor the driver reaps */
+	unsigned int hw;		/* next descriptor the hardware uses */
+	unsigned int doorbell;		/* TX: last value written to the doorbell */
+	unsigned int buf_len;		/* RX: size of the posted buffers */
+};
+
+#define MYETH_BENCH_MAX_SIZES	8
+
+/* Per-CPU benchmark counters, see the stats file in debugfs. */
+struct myeth_bench_stats {
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 lat_samples;	/* received frames carrying a timestamp */
+	u64 lat_sum;		/* ns */
+	u64 lat_min;
+	u64 lat_max;
+	u64 doorbells;		/* TX doorbell writes */
+};
+
+/* Packet generator and sink state of one interface. */
+struct myeth_bench {
+	struct mutex lock;		/* serializes start/stop */
+	struct dentry *dir;		/* debugfs: myeth/<ifname> */
+	struct task_struct *task;	/* generator thread */
+	u8 *tmpl;			/* template frame, largest size */
+	int active;			/* generator is transmitting */
+	u64 start;			/* ns, start of the measurement */
+
+	/* Configuration, written through debugfs. */
+	u32 rate;			/* frames per second, 0 = no limit */
+	u32 flows;			/* number of UDP source ports */
+	u64 count;			/* frames to send, 0 = until stopped */
+	u32 sink;			/* count and drop received frames */
+	u32 sizes[MYETH_BENCH_MAX_SIZES]; /* frame sizes, used round robin */
+	int nr_sizes;
+
+	struct myeth_bench_stats *stats; /* per-CPU */
+};
+
+struct myeth_tap;
+
+struct myeth_priv {
+	int status;
+	struct net_device *dev;
+	struct net_device *peer;	/* other end of the link, NULL if none */
+
+	struct myeth_ring tx;
+	struct tasklet_struct tx_flush;	/* rings the doorbell after a burst */
+	struct myeth_ring rx;
+	spinlock_t rx_lock;		/* protects rx_ready against the peer */
+	int rx_ready;			/* RX ring can take frames */
+	struct napi_struct napi;
+	struct hwtstamp_config hwts_config; /* SIOCSHWTSTAMP */
+	struct myeth_tap *tap;		/* RCU, set under rtnl_lock */
+
+	struct myeth_bench bench;
+};
+
+/* myeth_dev.c */
+extern int myeth_doorbell_batch;
+extern int myeth_hw_rx(struct net_device *dev, const void *data,
+		unsigned int len, u64 *now);
+extern int myeth_dev_is_myeth(const struct net_device *dev);
+
+/* myeth_tap.c */
+extern int myeth_tap_xmit(struct myeth_tap *tap, const void *data,
+		unsigned int len);
+extern void myeth_tap_wake(struct myeth_tap *tap);
+extern void myeth_tap_unregister(struct net_device *dev);
+extern int myeth_tap_init(void);
+extern void myeth_tap_exit(void);
+
+/* myeth_bench.c */
+extern int myeth_bench_attach(struct net_device *dev);
+extern void myeth_bench_detach(struct net_device *dev);
+extern void myeth_bench_rename(struct net_device *dev);
+extern int myeth_bench_rx(struct net_device *dev, struct sk_buff *skb);
+extern int myeth_bench_init(void);
+extern void myeth_bench_exit(void);
+
+#endif /* __KERNEL__ */
+
+#endif /* _MYETH_H */
@@ -0,0 +1,615 @@
+/*
+ * myeth_bench.c - In-kernel packet generator and sink for my ethernet driver.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * Every myeth interface gets a directory in debugfs, myeth/<ifname>, with
+ *
+ *	rate	frames per second to generate, 0 = as fast as possible
+ *	sizes	frame sizes, e.g. "64,512,1514", sent round robin
+ *	flows	number of distinct UDP source ports
+ *	count	frames to generate, 0 = until stopped
+ *	sink	non zero: count and drop received frames instead of passing
+ *		them to the stack
+ *	run	write 1 to start the generator, 0 to stop it
+ *	stats	per-CPU counters, pps, bps and latency; write to reset
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/skbuff.h>
+#include <net/ip.h>		/* ip_send_check() */
+
+#include "debug.h"
+#include "myeth.h"
+
+#define MYETH_BENCH_HLEN	(ETH_HLEN + sizeof(struct iphdr) +	\
+				 sizeof(struct udphdr))
+#define MYETH_BENCH_MIN_LEN	ETH_ZLEN
+#define MYETH_BENCH_SPIN_NS	20000	/* busy wait below this gap */
+#define MYETH_BENCH_PORT	9	/* discard */
+
+static struct dentry *myeth_bench_root;
+
+static inline u64 myeth_bench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* Build the template once, per-frame fields are patched by the generator. */
+static void myeth_bench_fill(struct net_device *dev, u8 *frame)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct ethhdr *eth = (struct ethhdr *)frame;
+	struct iphdr *iph = (struct iphdr *)(eth + 1);
+	struct udphdr *udph = (struct udphdr *)(iph + 1);
+	struct myeth_bench_hdr *bh = (struct myeth_bench_hdr *)(udph + 1);
+
+	if (priv->peer)
+		memcpy(eth->h_dest, priv->peer->dev_addr, ETH_ALEN);
+	else
+		memset(eth->h_dest, 0xff, ETH_ALEN);
+	memcpy(eth->h_source, dev->dev_addr, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	/* 198.18.0.0/15 is reserved for benchmarking (RFC 2544). */
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0xc6120001);
+	iph->daddr = htonl(0xc6120002);
+
+	udph->dest = htons(MYETH_BENCH_PORT);
+	udph->check = 0;
+
+	bh->magic = htonl(MYETH_BENCH_MAGIC);
+}
+
+static struct sk_buff *myeth_bench_build(struct net_device *dev,
+		struct myeth_bench *bench, unsigned int len, u32 seq, u32 flows)
+{
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	struct udphdr *udph;
+	struct myeth_bench_hdr *bh;
+
+	skb = netdev_alloc_skb(dev, len + NET_IP_ALIGN);
+	if (skb == NULL)
+		return NULL;
+
+	skb_reserve(skb, NET_IP_ALIGN);
+	memcpy(skb_put(skb, len), bench->tmpl, len);
+
+	iph = (struct iphdr *)(skb->data + ETH_HLEN);
+	iph->tot_len = htons(len - ETH_HLEN);
+	iph->id = htons(seq);
+	ip_send_check(iph);
+
+	udph = (struct udphdr *)(iph + 1);
+	udph->source = htons(1024 + seq % flows);
+	udph->len = htons(len - ETH_HLEN - sizeof(struct iphdr));
+
+	bh = (struct myeth_bench_hdr *)(udph + 1);
+	bh->seq = htonl(seq);
+	/* Only 4 byte aligned behind the UDP header. */
+	put_unaligned(myeth_bench_now(), &bh->tstamp);
+
+	skb->protocol = htons(ETH_P_IP);
+	return skb;
+}
+
+/* Wait until next, sleeping for long gaps and spinning for short ones. */
+static void myeth_bench_pace(u64 next)
+{
+	u64 now = myeth_bench_now();
+	ktime_t t;
+
+	if (now >= next)
+		return;
+
+	if (next - now > MYETH_BENCH_SPIN_NS) {
+		t = ns_to_ktime(next - MYETH_BENCH_SPIN_NS);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&t, HRTIMER_MODE_ABS);
+		if (kthread_should_stop())
+			return;
+	}
+
+	while (myeth_bench_now() < next)
+		cpu_relax();
+}
+
+static int myeth_bench_thread(void *data)
+{
+	struct net_device *dev = data;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
+	struct myeth_bench_stats *stats;
+	struct sk_buff *skb;
+	unsigned int len, size = 0;
+	int burst, n;
+	u64 sent = 0, gap, next;
+	/* debugfs may change these while we run, work on a snapshot. */
+	u32 rate = bench->rate, flows = bench->flows ? bench->flows : 1;
+	u64 count = bench->count;
+
+	entry_info();
+	gap = rate ? div_u64(NSEC_PER_SEC, rate) : 0;
+	next = myeth_bench_now();
+
+	while (!kthread_should_stop()) {
+		if (count && sent >= count)
+			break;
+		if (!netif_running(dev))
+			break;
+
+		/* Let the queue drain before building the next frames. */
+		if (netif_tx_queue_stopped(txq)) {
+			schedule_timeout_interruptible(1);
+			continue;
+		}
+
+		if (gap)
+			myeth_bench_pace(next);
+
+		/*
+		 * Send a burst in one lock section, as pktgen does: dropping
+		 * the lock runs the tx_flush tasklet, which would otherwise
+		 * ring the doorbell for every frame. With a rate, the burst
+		 * only takes the frames that are already due.
+		 */
+		burst = clamp(myeth_doorbell_batch, 1, MYETH_RING_SIZE);
+		__netif_tx_lock_bh(txq);
+		for (n = 0; n < burst; n++) {
+			if (count && sent >= count)
+				break;
+			if (!netif_running(dev) || netif_tx_queue_stopped(txq))
+				break;
+			if (gap) {
+				if (n && myeth_bench_now() < next)
+					break;
+				next += gap;
+			}
+
+			len = bench->sizes[size];
+			skb = myeth_bench_build(dev, bench, len, (u32)sent, flows);
+			if (skb == NULL)
+				break;
+
+			if (dev->netdev_ops->ndo_start_xmit(skb, dev) == NETDEV_TX_OK) {
+				stats = per_cpu_ptr(bench->stats, smp_processor_id());
+				stats->tx_packets++;
+				stats->tx_bytes += len;
+			} else {
+				kfree_skb(skb);
+			}
+			sent++;
+			if (++size == bench->nr_sizes)
+				size = 0;
+		}
+		__netif_tx_unlock_bh(txq);
+
+		/* Nothing sent: out of memory or the queue just stopped. */
+		if (n == 0)
+			schedule_timeout_interruptible(1);
+		else if (need_resched())
+			schedule();
+	}
+	bench->active = 0;
+	info("%s: generated %llu frames", dev->name, sent);
+
+	/* Stay around until myeth_bench_stop() reaps us. */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	exit_info();
+	return 0;
+}
+
+static void myeth_bench_stop(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+
+	if (bench->task) {
+		kthread_stop(bench->task);
+		bench->task = NULL;
+	}
+	kfree(bench->tmpl);
+	bench->tmpl = NULL;
+	bench->active = 0;
+}
+
+static int myeth_bench_start(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	unsigned int max_len = 0;
+	int i;
+
+	if (!netif_running(dev))
+		return -ENETDOWN;
+
+	myeth_bench_stop(dev);
+
+	for (i = 0; i < bench->nr_sizes; i++)
+		max_len = max(max_len, bench->sizes[i]);
+
+	bench->tmpl = kzalloc(max_len, GFP_KERNEL);
+	if (bench->tmpl == NULL)
+		return -ENOMEM;
+	myeth_bench_fill(dev, bench->tmpl);
+
+	bench->active = 1;
+	bench->task = kthread_run(myeth_bench_thread, dev, "%s-gen", dev->name);
+	if (IS_ERR(bench->task)) {
+		int ret = PTR_ERR(bench->task);
+
+		err("kthread_run failed");
+		bench->task = NULL;
+		myeth_bench_stop(dev);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Called for every frame the peer sends us. Returns 1 if the frame was
+ * consumed by the sink, 0 if it should go up the stack.
+ */
+int myeth_bench_rx(struct net_device *dev, struct sk_buff *skb)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	struct myeth_bench_stats *stats;
+	struct myeth_bench_hdr *bh;
+	u64 lat;
+
+	if (!bench->sink || bench->stats == NULL)
+		return 0;
+
+	stats = per_cpu_ptr(bench->stats, smp_processor_id());
+	stats->rx_packets++;
+	stats->rx_bytes += skb->len;
+
+	if (skb->len >= MYETH_BENCH_HLEN + sizeof(*bh) &&
+			!skb_is_nonlinear(skb)) {
+		bh = (struct myeth_bench_hdr *)(skb->data + MYETH_BENCH_HLEN);
+		if (bh->magic == htonl(MYETH_BENCH_MAGIC)) {
+			lat = myeth_bench_now() - get_unaligned(&bh->tstamp);
+			stats->lat_samples++;
+			stats->lat_sum += lat;
+			if (stats->lat_min == 0 || lat < stats->lat_min)
+				stats->lat_min = lat;
+			if (lat > stats->lat_max)
+				stats->lat_max = lat;
+		}
+	}
+
+	kfree_skb(skb);
+	return 1;
+}
+
+/* debugfs: sizes */
+static ssize_t myeth_bench_sizes_read(struct file *file, char __user *ubuff,
+		size_t count, loff_t *offset)
+{
+	struct net_device *dev = file->private_data;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	char buf[MYETH_BENCH_MAX_SIZES * 6 + 1];
+	int i, len = 0;
+
+	for (i = 0; i < bench->nr_sizes; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%u",
+				i ? "," : "", bench->sizes[i]);
+	len += snprintf(buf + len, sizeof(buf) - len, "\n");
+
+	return simple_read_from_buffer(ubuff, count, offset, buf, len);
+}
+
+static ssize_t myeth_bench_sizes_write(struct file *file,
+		const char __user *ubuff, size_t count, loff_t *offset)
+{
+	struct net_device *dev = file->private_data;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	u32 sizes[MYETH_BENCH_MAX_SIZES];
+	unsigned long size;
+	char buf[64], *p, *end;
+	int n = 0;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuff, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	for (p = buf; *p && *p != '\n'; p = end + 1) {
+		if (n == MYETH_BENCH_MAX_SIZES)
+			return -EINVAL;
+		size = simple_strtoul(p, &end, 0);
+		if (end == p)
+			return -EINVAL;
+		if (size < MYETH_BENCH_MIN_LEN || size > dev->mtu + ETH_HLEN)
+			return -EINVAL;
+		sizes[n++] = size;
+		if (*end != ',')
+			break;
+	}
+	if (n == 0)
+		return -EINVAL;
+
+	mutex_lock(&bench->lock);
+	if (bench->task) {
+		mutex_unlock(&bench->lock);
+		return -EBUSY;
+	}
+	memcpy(bench->sizes, sizes, sizeof(sizes));
+	bench->nr_sizes = n;
+	mutex_unlock(&bench->lock);
+
+	return count;
+}
+
+static int myeth_bench_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations myeth_bench_sizes_fops = {
+	.owner	= THIS_MODULE,
+	.open	= myeth_bench_open,
+	.read	= myeth_bench_sizes_read,
+	.write	= myeth_bench_sizes_write,
+};
+
+/* debugfs: run */
+static ssize_t myeth_bench_run_read(struct file *file, char __user *ubuff,
+		size_t count, loff_t *offset)
+{
+	struct net_device *dev = file->private_data;
+	struct myeth_priv *priv = netdev_priv(dev);
+	char buf[3];
+
+	snprintf(buf, sizeof(buf), "%d\n", priv->bench.active);
+	return simple_read_from_buffer(ubuff, count, offset, buf, 2);
+}
+
+static ssize_t myeth_bench_run_write(struct file *file,
+		const char __user *ubuff, size_t count, loff_t *offset)
+{
+	struct net_device *dev = file->private_data;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	char c;
+	int ret = 0;
+
+	if (count == 0)
+		return -EINVAL;
+	if (get_user(c, ubuff))
+		return -EFAULT;
+
+	mutex_lock(&bench->lock);
+	if (c == '1')
+		ret = myeth_bench_start(dev);
+	else if (c == '0')
+		myeth_bench_stop(dev);
+	else
+		ret = -EINVAL;
+	mutex_unlock(&bench->lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations myeth_bench_run_fops = {
+	.owner	= THIS_MODULE,
+	.open	= myeth_bench_open,
+	.read	= myeth_bench_run_read,
+	.write	= myeth_bench_run_write,
+};
+
+/* debugfs: stats */
+static void myeth_bench_show_line(struct seq_file *m, const char *name,
+		struct myeth_bench_stats *s, u64 ms)
+{
+	u64 avg = s->lat_samples ? div64_u64(s->lat_sum, s->lat_samples) : 0;
+
+	seq_printf(m, "%-6s %12llu %14llu %12llu %14llu %10llu %12llu "
+			"%10llu %12llu %8llu %8llu %8llu %10llu\n", name,
+			s->tx_packets, s->tx_bytes, s->rx_packets, s->rx_bytes,
+			div64_u64(s->tx_packets * MSEC_PER_SEC, ms),
+			div64_u64(s->tx_bytes * 8, ms) * MSEC_PER_SEC,
+			div64_u64(s->rx_packets * MSEC_PER_SEC, ms),
+			div64_u64(s->rx_bytes * 8, ms) * MSEC_PER_SEC,
+			s->lat_min, avg, s->lat_max, s->doorbells);
+}
+
+static int myeth_bench_stats_show(struct seq_file *m, void *v)
+{
+	struct net_device *dev = m->private;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	struct myeth_bench_stats total, *s;
+	char name[8];
+	u64 ms;
+	int cpu;
+
+	ms = div_u64(myeth_bench_now() - bench->start, NSEC_PER_MSEC);
+	if (ms == 0)
+		ms = 1;
+
+	memset(&total, 0, sizeof(total));
+	seq_printf(m, "%-6s %12s %14s %12s %14s %10s %12s %10s %12s "
+			"%8s %8s %8s %10s\n", "cpu", "tx_packets", "tx_bytes",
+			"rx_packets", "rx_bytes", "tx_pps", "tx_bps",
+			"rx_pps", "rx_bps", "lat_min", "lat_avg", "lat_max",
+			"doorbells");
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(bench->stats, cpu);
+		if (s->tx_packets == 0 && s->rx_packets == 0 &&
+				s->doorbells == 0)
+			continue;
+
+		snprintf(name, sizeof(name), "%d", cpu);
+		myeth_bench_show_line(m, name, s, ms);
+
+		total.tx_packets += s->tx_packets;
+		total.tx_bytes += s->tx_bytes;
+		total.rx_packets += s->rx_packets;
+		total.rx_bytes += s->rx_bytes;
+		total.lat_samples += s->lat_samples;
+		total.lat_sum += s->lat_sum;
+		if (s->lat_min && (total.lat_min == 0 || s->lat_min < total.lat_min))
+			total.lat_min = s->lat_min;
+		if (s->lat_max > total.lat_max)
+			total.lat_max = s->lat_max;
+		total.doorbells += s->doorbells;
+	}
+	myeth_bench_show_line(m, "total", &total, ms);
+	seq_printf(m, "elapsed %llu ms, latency in ns\n", ms);
+	return 0;
+}
+
+static int myeth_bench_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, myeth_bench_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters and restarts the measurement. */
+static ssize_t myeth_bench_stats_write(struct file *file,
+		const char __user *ubuff, size_t count, loff_t *offset)
+{
+	struct seq_file *m = file->private_data;
+	struct net_device *dev = m->private;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(bench->stats, cpu), 0,
+				sizeof(struct myeth_bench_stats));
+	bench->start = myeth_bench_now();
+
+	return count;
+}
+
+static const struct file_operations myeth_bench_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myeth_bench_stats_open,
+	.read		= seq_read,
+	.write		= myeth_bench_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int myeth_bench_attach(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+
+	entry_info();
+	mutex_init(&bench->lock);
+	bench->rate = 0;
+	bench->flows = 1;
+	bench->count = 0;
+	bench->sink = 0;
+	bench->sizes[0] = MYETH_BENCH_MIN_LEN;
+	bench->nr_sizes = 1;
+	bench->start = myeth_bench_now();
+
+	bench->stats = alloc_percpu(struct myeth_bench_stats);
+	if (bench->stats == NULL) {
+		err("Couldn't allocate benchmark counters");
+		return -ENOMEM;
+	}
+
+	/* debugfs is optional, the sink still works without it. */
+	if (myeth_bench_root == NULL)
+		goto out;
+
+	bench->dir = debugfs_create_dir(dev->name, myeth_bench_root);
+	if (bench->dir == NULL)
+		goto out;
+
+	debugfs_create_u32("rate", 0600, bench->dir, &bench->rate);
+	debugfs_create_u32("flows", 0600, bench->dir, &bench->flows);
+	debugfs_create_u64("count", 0600, bench->dir, &bench->count);
+	debugfs_create_u32("sink", 0600, bench->dir, &bench->sink);
+	debugfs_create_file("sizes", 0600, bench->dir, dev,
+			&myeth_bench_sizes_fops);
+	debugfs_create_file("run", 0600, bench->dir, dev,
+			&myeth_bench_run_fops);
+	debugfs_create_file("stats", 0600, bench->dir, dev,
+			&myeth_bench_stats_fops);
+out:
+	exit_info();
+	return 0;
+}
+
+void myeth_bench_detach(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+
+	entry_info();
+	debugfs_remove_recursive(bench->dir);
+	bench->dir = NULL;
+
+	mutex_lock(&bench->lock);
+	myeth_bench_stop(dev);
+	mutex_unlock(&bench->lock);
+
+	/* The peer may still be transmitting to us, let it finish first. */
+	bench->sink = 0;
+	synchronize_net();
+	free_percpu(bench->stats);
+	bench->stats = NULL;
+	exit_info();
+}
+
+void myeth_bench_rename(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_bench *bench = &priv->bench;
+
+	if (bench->dir)
+		debugfs_rename(myeth_bench_root, bench->dir,
+				myeth_bench_root, dev->name);
+}
+
+int myeth_bench_init(void)
+{
+	myeth_bench_root = debugfs_create_dir(MYETH_KIND, NULL);
+	if (IS_ERR(myeth_bench_root)) /* debugfs not configured */
+		myeth_bench_root = NULL;
+	return 0;
+}
+
+void myeth_bench_exit(void)
+{
+	debugfs_remove_recursive(myeth_bench_root);
+	myeth_bench_root = NULL;
+}
@@ -24,20 +24,26 @@
 #include <linux/ip.h>          /* struct iphdr */
 #include <linux/tcp.h>         /* struct tcphdr */
 #include <linux/skbuff.h>
+#include <linux/net_tstamp.h>  /* struct hwtstamp_config */
+#include <linux/uaccess.h>     /* copy_from_user() */
+#include <net/rtnetlink.h>     /* struct rtnl_link_ops */
 
 #include "debug.h"
+#include "myeth.h"
 
-#define MAX_MYETH_DEVS	5
-
-static struct net_device *myeth[MAX_MYETH_DEVS];
+#define DRV_NAME	MYETH_KIND
 
 static int myethdevs = 2;
 module_param(myethdevs, int, 0);
-MODULE_PARM_DESC(myethdevs, " Number of ethernet interfaces");
+MODULE_PARM_DESC(myethdevs, " Number of ethernet interfaces created at load,"
+		" consecutive ones are paired");
 
-struct myeth_priv {
-	int status;
-};
+int myeth_doorbell_batch = 32;
+module_param_named(doorbell_batch, myeth_doorbell_batch, int, 0644);
+MODULE_PARM_DESC(doorbell_batch, " Frames posted per TX doorbell write,"
+		" 1 rings it for every frame");
+
+static struct rtnl_link_ops myeth_link_ops;
 
 static int myeth_dev_init(struct net_device *dev)
 {
@@ -68,43 +74,542 @@ static int myeth_config(struct net_device *dev, struct ifmap *map)
 	return 0;
 }
 
-static int myeth_open(struct net_device *dev)
+/* Emulated NIC, see the ring definitions in myeth.h. */
+static inline unsigned int myeth_ring_space(struct myeth_ring *ring)
+{
+	return MYETH_RING_SIZE - (ring->prod - ring->cons);
+}
+
+static inline u16 myeth_desc_flags(struct myeth_desc *desc)
+{
+	return ACCESS_ONCE(desc->flags);
+}
+
+/*
+ * The device clock is CLOCK_MONOTONIC. The stamp is also reported as
+ * system time, for SOF_TIMESTAMPING_SYS_HARDWARE users.
+ */
+static void myeth_hwtstamp(struct skb_shared_hwtstamps *hwts, u64 ns)
+{
+	ktime_t age = ktime_sub(ktime_get(), ns_to_ktime(ns));
+
+	hwts->hwtstamp = ns_to_ktime(ns);
+	hwts->syststamp = ktime_sub(ktime_get_real(), age);
+}
+
+/*
+ * A real NIC would get its descriptors from dma_alloc_coherent() and map
+ * every buffer with dma_map_single(). There is no bus device behind myeth,
+ * so the "hardware" sees kernel virtual addresses instead.
+ */
+static int myeth_ring_alloc(struct myeth_ring *ring)
+{
+	memset(ring, 0, sizeof(struct myeth_ring));
+	ring->desc = kcalloc(MYETH_RING_SIZE, sizeof(struct myeth_desc),
+			GFP_KERNEL);
+	if (ring->desc == NULL)
+		return -ENOMEM;
+
+	ring->skb = kcalloc(MYETH_RING_SIZE, sizeof(struct sk_buff *),
+			GFP_KERNEL);
+	if (ring->skb == NULL) {
+		kfree(ring->desc);
+		ring->desc = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void myeth_ring_free(struct myeth_ring *ring)
 {
 	int i;
 
+	if (ring->skb) {
+		for (i = 0; i < MYETH_RING_SIZE; i++)
+			if (ring->skb[i])
+				dev_kfree_skb(ring->skb[i]);
+	}
+	kfree(ring->skb);
+	kfree(ring->desc);
+	ring->skb = NULL;
+	ring->desc = NULL;
+}
+
+/*
+ * The hardware side of a receive: copy the frame into the next buffer
+ * posted on dev's RX ring. The caller holds dev's rx_lock and raises the
+ * RX "interrupt" unless -ENETDOWN is returned. *now is the wire time,
+ * taken here if it is 0 and dev stamps received frames.
+ */
+int myeth_hw_rx(struct net_device *dev, const void *data, unsigned int len,
+		u64 *now)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_ring *rx = &priv->rx;
+	struct myeth_desc *rxd;
+	int rx_tstamp;
+
+	if (!priv->rx_ready)
+		return -ENETDOWN;
+
+	rxd = &rx->desc[rx->hw & MYETH_RING_MASK];
+	if (!(myeth_desc_flags(rxd) & MYETH_DESC_OWN)) {
+		/* The driver did not post a buffer in time. */
+		dev->stats.rx_missed_errors++;
+		return -ENOBUFS;
+	}
+	rmb(); /* buffer address after ownership */
+
+	if (len > rxd->len) {
+		dev->stats.rx_length_errors++;
+		return -EMSGSIZE;
+	}
+
+	memcpy((void *)(unsigned long)rxd->addr, data, len);
+	rxd->len = len;
+
+	rx_tstamp = priv->hwts_config.rx_filter != HWTSTAMP_FILTER_NONE;
+	if (rx_tstamp) {
+		if (*now == 0)
+			*now = ktime_to_ns(ktime_get());
+		rxd->tstamp = *now;
+	}
+	wmb(); /* frame and length before handing the buffer back */
+	rxd->flags = MYETH_DESC_DONE | (rx_tstamp ? MYETH_DESC_TSTAMP : 0);
+	rx->hw++;
+	return 0;
+}
+
+/*
+ * The hardware side of a transmit: move every frame up to the doorbell to
+ * the peer, or to the TAP endpoint when one is attached.
+ */
+static void myeth_hw_xmit(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_priv *ppriv = NULL;
+	struct net_device *peer = priv->peer;
+	struct myeth_ring *tx = &priv->tx;
+	struct myeth_tap *tap;
+	struct myeth_desc *txd;
+	void *data;
+	int rx_irq = 0;
+	u64 now;
+
+	rcu_read_lock();
+	tap = rcu_dereference(priv->tap);
+	if (tap == NULL && peer) {
+		ppriv = netdev_priv(peer);
+		spin_lock(&ppriv->rx_lock);
+	}
+
+	while (tx->hw != tx->doorbell) {
+		txd = &tx->desc[tx->hw & MYETH_RING_MASK];
+		rmb(); /* descriptor contents after the doorbell */
+
+		data = (void *)(unsigned long)txd->addr;
+		now = 0;
+		if (txd->flags & MYETH_DESC_TSTAMP)
+			now = ktime_to_ns(ktime_get());
+
+		if (tap) {
+			if (myeth_tap_xmit(tap, data, txd->len))
+				dev->stats.tx_fifo_errors++;
+		} else if (ppriv == NULL ||
+				myeth_hw_rx(peer, data, txd->len, &now) == -ENETDOWN) {
+			dev->stats.tx_carrier_errors++;
+		} else {
+			rx_irq = 1;
+		}
+
+		/* Both ends see the frame on the wire at the same time. */
+		txd->tstamp = now;
+		wmb();
+		txd->flags = (txd->flags & MYETH_DESC_TSTAMP) | MYETH_DESC_DONE;
+		tx->hw++;
+	}
+
+	if (ppriv)
+		spin_unlock(&ppriv->rx_lock);
+	if (tap)
+		myeth_tap_wake(tap);
+	rcu_read_unlock();
+
+	/* Raise the TX completion and the peer's RX "interrupts". */
+	napi_schedule(&priv->napi);
+	if (rx_irq)
+		napi_schedule(&ppriv->napi);
+}
+
+/* Called with the TX lock held. */
+static void myeth_doorbell(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+
+	if (priv->tx.doorbell == priv->tx.prod)
+		return;
+
+	wmb(); /* descriptors before the doorbell */
+	priv->tx.doorbell = priv->tx.prod;
+	if (priv->bench.stats)
+		per_cpu_ptr(priv->bench.stats, smp_processor_id())->doorbells++;
+	myeth_hw_xmit(dev);
+}
+
+/* Rings the doorbell for the tail of a burst that did not fill a batch. */
+static void myeth_tx_flush(unsigned long data)
+{
+	struct net_device *dev = (struct net_device *)data;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
+
+	__netif_tx_lock(txq, smp_processor_id());
+	myeth_doorbell(dev);
+	__netif_tx_unlock(txq);
+}
+
+/* Reap the descriptors the hardware is done with. */
+static void myeth_tx_clean(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_ring *tx = &priv->tx;
+	struct myeth_desc *desc;
+	struct skb_shared_hwtstamps hwts;
+	struct sk_buff *skb;
+	unsigned int i;
+
+	while (tx->cons != tx->prod) {
+		i = tx->cons & MYETH_RING_MASK;
+		desc = &tx->desc[i];
+		if (!(myeth_desc_flags(desc) & MYETH_DESC_DONE))
+			break;
+		rmb();
+
+		skb = tx->skb[i];
+		tx->skb[i] = NULL;
+		if (desc->flags & MYETH_DESC_TSTAMP) {
+			myeth_hwtstamp(&hwts, desc->tstamp);
+			skb_tstamp_tx(skb, &hwts);
+		}
+		desc->flags = 0;
+		dev->stats.tx_packets++;
+		dev->stats.tx_bytes += skb->len;
+		dev_kfree_skb(skb);
+		/* Slot cleared before myeth_xmit() may see it free and reuse it. */
+		smp_wmb();
+		tx->cons++;
+	}
+
+	/* Pairs with the barrier in myeth_xmit() after stopping the queue. */
+	smp_mb();
+	if (netif_queue_stopped(dev) && myeth_ring_space(tx) >= MYETH_TX_WAKE)
+		netif_wake_queue(dev);
+}
+
+/* Post fresh buffers on every free RX descriptor. */
+static void myeth_rx_refill(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_ring *rx = &priv->rx;
+	struct myeth_desc *desc;
+	struct sk_buff *skb;
+	unsigned int i;
+
+	while (myeth_ring_space(rx)) {
+		skb = netdev_alloc_skb(dev, rx->buf_len + NET_IP_ALIGN);
+		if (skb == NULL)
+			break;
+		skb_reserve(skb, NET_IP_ALIGN);
+
+		i = rx->prod & MYETH_RING_MASK;
+		desc = &rx->desc[i];
+		rx->skb[i] = skb;
+		desc->addr = (unsigned long)skb->data;
+		desc->len = rx->buf_len;
+		wmb(); /* buffer before ownership */
+		desc->flags = MYETH_DESC_OWN;
+		rx->prod++;
+	}
+}
+
+static int myeth_rx(struct net_device *dev, int budget)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_ring *rx = &priv->rx;
+	struct myeth_desc *desc;
+	struct sk_buff *skb;
+	unsigned int i;
+	int done = 0;
+
+	while (done < budget && rx->cons != rx->prod) {
+		i = rx->cons & MYETH_RING_MASK;
+		desc = &rx->desc[i];
+		if (!(myeth_desc_flags(desc) & MYETH_DESC_DONE))
+			break;
+		rmb(); /* length after the write back */
+
+		skb = rx->skb[i];
+		rx->skb[i] = NULL;
+		skb_put(skb, desc->len);
+		if (desc->flags & MYETH_DESC_TSTAMP)
+			myeth_hwtstamp(skb_hwtstamps(skb), desc->tstamp);
+		desc->flags = 0;
+		rx->cons++;
+		done++;
+
+		dev->stats.rx_packets++;
+		dev->stats.rx_bytes += skb->len;
+
+		/* In sink mode the frame is counted and dropped. */
+		if (myeth_bench_rx(dev, skb))
+			continue;
+
+		skb->protocol = eth_type_trans(skb, dev);
+		netif_receive_skb(skb);
+	}
+
+	myeth_rx_refill(dev);
+	return done;
+}
+
+static int myeth_poll(struct napi_struct *napi, int budget)
+{
+	struct myeth_priv *priv = container_of(napi, struct myeth_priv, napi);
+	struct myeth_desc *desc;
+	int done;
+
+	myeth_tx_clean(priv->dev);
+	done = myeth_rx(priv->dev, budget);
+
+	if (done < budget) {
+		napi_complete(napi);
+		/*
+		 * There is no interrupt to unmask, look again for work the
+		 * hardware posted after our last check.
+		 */
+		desc = &priv->rx.desc[priv->rx.cons & MYETH_RING_MASK];
+		if (myeth_desc_flags(desc) & MYETH_DESC_DONE) {
+			napi_schedule(napi);
+			return done;
+		}
+
+		/*
+		 * TX completions too: their napi_schedule() is lost while we
+		 * run, and a stopped queue would never be woken.
+		 */
+		if (priv->tx.cons != ACCESS_ONCE(priv->tx.prod)) {
+			desc = &priv->tx.desc[priv->tx.cons & MYETH_RING_MASK];
+			if (myeth_desc_flags(desc) & MYETH_DESC_DONE)
+				napi_schedule(napi);
+		}
+	}
+	return done;
+}
+
+static int myeth_open(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	int ret;
+
 	entry_info();
-	memcpy(dev->dev_addr, "\0BADF0", ETH_ALEN);
-	for (i = 0; i < myethdevs; i++) {
-		if (dev == myeth[i])
-			dev->dev_addr[ETH_ALEN-1] += i;
+	ret = myeth_ring_alloc(&priv->tx);
+	if (ret < 0)
+		goto out;
+
+	ret = myeth_ring_alloc(&priv->rx);
+	if (ret < 0)
+		goto free_tx;
+
+	priv->rx.buf_len = dev->mtu + ETH_HLEN;
+	myeth_rx_refill(dev);
+	if (priv->rx.prod == 0) {
+		err("Couldn't post RX buffers");
+		ret = -ENOMEM;
+		goto free_rx;
+	}
+
+	napi_enable(&priv->napi);
+	spin_lock_bh(&priv->rx_lock);
+	priv->rx_ready = 1;
+	spin_unlock_bh(&priv->rx_lock);
+
+	/* The link is up once both ends are open. */
+	if (priv->peer && (priv->peer->flags & IFF_UP)) {
+		netif_carrier_on(dev);
+		netif_carrier_on(priv->peer);
 	}
+	/* An attached TAP endpoint is always open. */
+	if (priv->tap)
+		netif_carrier_on(dev);
 
 	/* Tells the kernel that the driver is ready to send packets. */
 	netif_start_queue(dev);
 	exit_info();
 	return 0;
+
+free_rx:
+	myeth_ring_free(&priv->rx);
+free_tx:
+	myeth_ring_free(&priv->tx);
+out:
+	exit_info();
+	return ret;
 }
 
 static int myeth_close(struct net_device *dev)
 {
+	struct myeth_priv *priv = netdev_priv(dev);
+
 	entry_info();
 	/* Tells the kernel to stop sending packets. */
 	netif_stop_queue(dev);
+	netif_carrier_off(dev);
+	if (priv->peer)
+		netif_carrier_off(priv->peer);
+
+	tasklet_kill(&priv->tx_flush);
+	/* Keep the peer's hardware and the TAP away from our RX ring. */
+	spin_lock_bh(&priv->rx_lock);
+	priv->rx_ready = 0;
+	spin_unlock_bh(&priv->rx_lock);
+	napi_disable(&priv->napi);
+
+	myeth_ring_free(&priv->tx);
+	myeth_ring_free(&priv->rx);
 	exit_info();
 	return 0;
 }
 
+/*
+ * Post the frame on the TX ring. The doorbell is written once per
+ * doorbell_batch frames, or by the tx_flush tasklet once the burst is
+ * over, instead of once per frame.
+ */
 static netdev_tx_t myeth_xmit(struct sk_buff *skb, struct net_device *dev)
 {
-	entry_info();
-	info("In transmit");
-	exit_info();
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct myeth_ring *tx = &priv->tx;
+	struct myeth_desc *desc;
+	union skb_shared_tx *shtx;
+	unsigned int i;
+
+	/*
+	 * The hardware copies bytes into a fresh RX buffer, so a checksum
+	 * left for offload (NETIF_F_NO_CSUM) must be finished here.
+	 */
+	if (skb_linearize(skb) || (skb->ip_summed == CHECKSUM_PARTIAL &&
+				skb_checksum_help(skb))) {
+		dev->stats.tx_dropped++;
+		dev_kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+
+	if (myeth_ring_space(tx) == 0) {
+		/* Never happens, the queue is stopped when the ring fills up. */
+		err("TX ring full while queue awake");
+		netif_stop_queue(dev);
+		return NETDEV_TX_BUSY;
+	}
+
+	i = tx->prod & MYETH_RING_MASK;
+	desc = &tx->desc[i];
+	tx->skb[i] = skb;
+	desc->addr = (unsigned long)skb->data;
+	desc->len = skb->len;
+	desc->tstamp = 0;
+	desc->flags = MYETH_DESC_OWN;
+
+	/* Ask the hardware for the wire time if the socket wants it. */
+	shtx = skb_tx(skb);
+	if (shtx->hardware &&
+			priv->hwts_config.tx_type == HWTSTAMP_TX_ON) {
+		shtx->in_progress = 1;
+		desc->flags |= MYETH_DESC_TSTAMP;
+	}
+	tx->prod++;
+
+	if (myeth_ring_space(tx) == 0) {
+		netif_stop_queue(dev);
+		/* Pairs with the barrier in myeth_tx_clean(). */
+		smp_mb();
+		if (myeth_ring_space(tx) >= MYETH_TX_WAKE)
+			netif_start_queue(dev);
+	}
+
+	if (netif_queue_stopped(dev) ||
+			(int)(tx->prod - tx->doorbell) >= myeth_doorbell_batch)
+		myeth_doorbell(dev);
+	else
+		tasklet_schedule(&priv->tx_flush);
+
 	return NETDEV_TX_OK;
 }
 
+/* SIOCSHWTSTAMP: the device can stamp every TX and RX frame. */
+static int myeth_hwtstamp_set(struct net_device *dev, struct ifreq *rq)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct hwtstamp_config config;
+
+	if (copy_from_user(&config, rq->ifr_data, sizeof(config)))
+		return -EFAULT;
+
+	/* reserved for future extensions */
+	if (config.flags)
+		return -EINVAL;
+
+	switch (config.tx_type) {
+	case HWTSTAMP_TX_OFF:
+	case HWTSTAMP_TX_ON:
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	/* Any known filter is satisfied by stamping everything. */
+	switch (config.rx_filter) {
+	case HWTSTAMP_FILTER_NONE:
+		break;
+	case HWTSTAMP_FILTER_ALL:
+	case HWTSTAMP_FILTER_SOME:
+	case HWTSTAMP_FILTER_PTP_V1_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V1_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V1_L4_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L4_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_L2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ:
+	case HWTSTAMP_FILTER_PTP_V2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+		break;
+	default:
+		return -ERANGE;
+	}
+
+	priv->hwts_config = config;
+
+	return copy_to_user(rq->ifr_data, &config, sizeof(config)) ?
+		-EFAULT : 0;
+}
+
 static int myeth_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 {
-	return 0;
+	struct myeth_priv *priv = netdev_priv(dev);
+
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return myeth_hwtstamp_set(dev, rq);
+#ifdef SIOCGHWTSTAMP
+	case SIOCGHWTSTAMP:
+		return copy_to_user(rq->ifr_data, &priv->hwts_config,
+				sizeof(priv->hwts_config)) ? -EFAULT : 0;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
 }
 
 /* Set mac address. */
@@ -139,46 +644,313 @@ static void myeth_setup(struct net_device *dev)
 	dev->flags	|= IFF_NOARP;
 	dev->features	|= NETIF_F_NO_CSUM;
 	dev->netdev_ops	= &myeth_ops;
+	dev->rtnl_link_ops = &myeth_link_ops;
+	dev->destructor	= free_netdev;
 
 	/* Initialize the priv field. */
 	priv = netdev_priv(dev);
 	memset(priv, 0, sizeof(struct myeth_priv));
+	priv->dev = dev;
+	priv->hwts_config.tx_type = HWTSTAMP_TX_OFF;
+	priv->hwts_config.rx_filter = HWTSTAMP_FILTER_NONE;
+	spin_lock_init(&priv->rx_lock);
+	tasklet_init(&priv->tx_flush, myeth_tx_flush, (unsigned long)dev);
+	netif_napi_add(dev, &priv->napi, myeth_poll, MYETH_NAPI_WEIGHT);
 	exit_info();
 	return;
 }
 
-static int __init myeth_init(void)
+/*
+ * rtnetlink link operations, "ip link add NAME type myeth peer name PEER"
+ * creates both ends of a link in one request.
+ */
+static int myeth_validate(struct nlattr *tb[], struct nlattr *data[])
 {
-	int i;
+	if (tb[IFLA_ADDRESS]) {
+		if (nla_len(tb[IFLA_ADDRESS]) != ETH_ALEN)
+			return -EINVAL;
+		if (!is_valid_ether_addr(nla_data(tb[IFLA_ADDRESS])))
+			return -EADDRNOTAVAIL;
+	}
+	return 0;
+}
+
+static const struct nla_policy myeth_policy[MYETH_INFO_MAX + 1] = {
+	[MYETH_INFO_PEER]	= { .len = sizeof(struct ifinfomsg) },
+};
+
+static void myeth_pair(struct net_device *dev, struct net_device *peer)
+{
+	struct myeth_priv *priv;
+
+	priv = netdev_priv(dev);
+	priv->peer = peer;
+	priv = netdev_priv(peer);
+	priv->peer = dev;
+}
+
+static int myeth_newlink(struct net_device *dev,
+		struct nlattr *tb[], struct nlattr *data[])
+{
+	int ret;
+	char ifname[IFNAMSIZ];
+	struct net_device *peer;
+	struct nlattr *peer_tb[IFLA_MAX + 1], **tbp;
+	struct ifinfomsg *ifmp;
+	struct net *net;
 
 	entry_info();
-	if (myethdevs > MAX_MYETH_DEVS)
-		myethdevs = MAX_MYETH_DEVS;
+	/* Parse the attributes of the peer, if any were given. */
+	if (data != NULL && data[MYETH_INFO_PEER] != NULL) {
+		struct nlattr *nla_peer = data[MYETH_INFO_PEER];
+
+		ifmp = nla_data(nla_peer);
+		ret = nla_parse(peer_tb, IFLA_MAX,
+				nla_data(nla_peer) + sizeof(struct ifinfomsg),
+				nla_len(nla_peer) - sizeof(struct ifinfomsg),
+				ifla_policy);
+		if (ret < 0)
+			return ret;
+
+		ret = myeth_validate(peer_tb, NULL);
+		if (ret < 0)
+			return ret;
+
+		tbp = peer_tb;
+	} else {
+		ifmp = NULL;
+		tbp = tb;
+	}
 
-	for (i = 0; i < myethdevs; i++) {
-		myeth[i] = alloc_netdev(sizeof(struct myeth_priv), "myeth%d", myeth_setup);
-		if (myeth[i] == NULL) {
-			err("alloc_netdev failed");
-			return -ENOMEM;
-		}
+	if (tbp[IFLA_IFNAME])
+		nla_strlcpy(ifname, tbp[IFLA_IFNAME], IFNAMSIZ);
+	else
+		snprintf(ifname, IFNAMSIZ, DRV_NAME "%%d");
+
+	net = rtnl_link_get_net(dev_net(dev), tbp);
+	if (IS_ERR(net))
+		return PTR_ERR(net);
+
+	peer = rtnl_create_link(net, ifname, &myeth_link_ops, tbp);
+	if (IS_ERR(peer)) {
+		put_net(net);
+		return PTR_ERR(peer);
+	}
+
+	if (tbp[IFLA_ADDRESS] == NULL)
+		random_ether_addr(peer->dev_addr);
+
+	ret = register_netdevice(peer);
+	put_net(net);
+	if (ret < 0) {
+		err("register_netdevice failed for peer");
+		free_netdev(peer);
+		return ret;
+	}
+	netif_carrier_off(peer);
+
+	ret = rtnl_configure_link(peer, ifmp);
+	if (ret < 0)
+		goto unregister_peer;
+
+	/* Now the device the request was made for. */
+	if (tb[IFLA_ADDRESS] == NULL)
+		random_ether_addr(dev->dev_addr);
+
+	if (tb[IFLA_IFNAME])
+		nla_strlcpy(dev->name, tb[IFLA_IFNAME], IFNAMSIZ);
+	else
+		snprintf(dev->name, IFNAMSIZ, DRV_NAME "%%d");
+
+	if (strchr(dev->name, '%')) {
+		ret = dev_alloc_name(dev, dev->name);
+		if (ret < 0)
+			goto unregister_peer;
 	}
 
-	for (i = 0; i < myethdevs; i++)
-		register_netdev(myeth[i]);
+	ret = register_netdevice(dev);
+	if (ret < 0) {
+		err("register_netdevice failed");
+		goto unregister_peer;
+	}
+	netif_carrier_off(dev);
 
+	myeth_pair(dev, peer);
 	exit_info();
 	return 0;
+
+unregister_peer:
+	unregister_netdevice(peer);
+	exit_info();
+	return ret;
 }
 
-static void __exit myeth_exit(void)
+/* Removing either end of a link removes both. Called with rtnl held. */
+static void myeth_dellink(struct net_device *dev)
 {
-	int i;
+	struct myeth_priv *priv = netdev_priv(dev);
+	struct net_device *peer = priv->peer;
+
+	entry_info();
+	unregister_netdevice(dev);
+	if (peer) {
+		priv = netdev_priv(peer);
+		priv->peer = NULL;
+		unregister_netdevice(peer);
+	}
+	exit_info();
+}
+
+/* Tells myeth interfaces apart from others, see myeth_tap.c. */
+int myeth_dev_is_myeth(const struct net_device *dev)
+{
+	return dev->rtnl_link_ops == &myeth_link_ops;
+}
+
+/* Keeps the benchmark and TAP state of each myeth interface in step with it. */
+static int myeth_netdev_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct net_device *dev = ptr;
+
+	if (!myeth_dev_is_myeth(dev))
+		return NOTIFY_DONE;
+
+	switch (event) {
+	case NETDEV_REGISTER:
+		if (myeth_bench_attach(dev))
+			return NOTIFY_BAD;
+		break;
+	case NETDEV_UNREGISTER:
+		myeth_tap_unregister(dev);
+		myeth_bench_detach(dev);
+		break;
+	case NETDEV_CHANGENAME:
+		myeth_bench_rename(dev);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block myeth_notifier = {
+	.notifier_call	= myeth_netdev_event,
+};
+
+static struct rtnl_link_ops myeth_link_ops = {
+	.kind		= DRV_NAME,
+	.priv_size	= sizeof(struct myeth_priv),
+	.setup		= myeth_setup,
+	.validate	= myeth_validate,
+	.newlink	= myeth_newlink,
+	.dellink	= myeth_dellink,
+	.policy		= myeth_policy,
+	.maxtype	= MYETH_INFO_MAX,
+};
+
+/* Create one of the interfaces requested through myethdevs. */
+static struct net_device *myeth_create(int index)
+{
+	struct net_device *dev;
+	int ret;
+
+	dev = alloc_netdev(sizeof(struct myeth_priv), DRV_NAME "%d", myeth_setup);
+	if (dev == NULL) {
+		err("alloc_netdev failed");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/* "\0BADF0" to "\0BADF9", the rest would wrap and repeat. */
+	if (index < 10) {
+		memcpy(dev->dev_addr, "\0BADF0", ETH_ALEN);
+		dev->dev_addr[ETH_ALEN-1] += index;
+	} else {
+		random_ether_addr(dev->dev_addr);
+	}
+
+	/* register_netdevice() does not expand the %d, unlike register_netdev() */
+	ret = dev_alloc_name(dev, dev->name);
+	if (ret < 0)
+		goto free_dev;
+
+	ret = register_netdevice(dev);
+	if (ret < 0)
+		goto free_dev;
+
+	netif_carrier_off(dev);
+	return dev;
+
+free_dev:
+	err("register_netdevice failed");
+	free_netdev(dev);
+	return ERR_PTR(ret);
+}
+
+static int __init myeth_init(void)
+{
+	struct net_device *dev, *prev = NULL;
+	int i, ret;
 
 	entry_info();
+	ret = myeth_bench_init();
+	if (ret < 0)
+		return ret;
+
+	ret = myeth_tap_init();
+	if (ret < 0)
+		goto bench_exit;
+
+	ret = register_netdevice_notifier(&myeth_notifier);
+	if (ret < 0) {
+		err("register_netdevice_notifier failed");
+		goto tap_exit;
+	}
+
+	ret = rtnl_link_register(&myeth_link_ops);
+	if (ret < 0) {
+		err("rtnl_link_register failed");
+		goto unregister_notifier;
+	}
+
+	rtnl_lock();
 	for (i = 0; i < myethdevs; i++) {
-		unregister_netdev(myeth[i]);
-		free_netdev(myeth[i]);
+		dev = myeth_create(i);
+		if (IS_ERR(dev)) {
+			ret = PTR_ERR(dev);
+			goto unregister_links;
+		}
+
+		/* Pair myeth0 with myeth1, myeth2 with myeth3 and so on. */
+		if (i & 1)
+			myeth_pair(prev, dev);
+		prev = dev;
 	}
+	rtnl_unlock();
+
+	exit_info();
+	return 0;
+
+unregister_links:
+	rtnl_unlock();
+	/* Also removes the interfaces created so far. */
+	rtnl_link_unregister(&myeth_link_ops);
+unregister_notifier:
+	unregister_netdevice_notifier(&myeth_notifier);
+tap_exit:
+	myeth_tap_exit();
+bench_exit:
+	myeth_bench_exit();
+	exit_info();
+	return ret;
+}
+
+static void __exit myeth_exit(void)
+{
+	entry_info();
+	/* Deletes every myeth interface, static or created through netlink. */
+	rtnl_link_unregister(&myeth_link_ops);
+	unregister_netdevice_notifier(&myeth_notifier);
+	myeth_tap_exit();
+	myeth_bench_exit();
 	exit_info();
 }
 
@@ -187,3 +959,4 @@ module_exit(myeth_exit);
 
 MODULE_LICENSE("GPLv2");
 MODULE_AUTHOR("Faisal Hassan <faah87@gmail.com>");
+MODULE_ALIAS_RTNL_LINK(DRV_NAME);
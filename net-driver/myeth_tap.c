@@ -0,0 +1,608 @@
+/*
+ * myeth_tap.c - TAP endpoint for my ethernet driver.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * /dev/myethtap puts user space at the far end of a myeth link, in place
+ * of the peer: the emulated hardware hands transmitted frames to the file,
+ * and frames from the file go through the RX ring and NAPI like frames
+ * from the peer. See myeth.h for the interface.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/nsproxy.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/rtnetlink.h>
+#include <net/net_namespace.h>
+
+#include "debug.h"
+#include "myeth.h"
+
+#define MYETH_TAP_NAME		"myethtap"
+#define MYETH_TAP_BATCH		(64 * 1024)	/* write() bounce buffer */
+
+/* The two rings of the mmap()'d area. */
+#define MYETH_TAP_RX		0	/* to user space */
+#define MYETH_TAP_TX		1	/* from user space */
+
+struct myeth_tap {
+	struct net_device *dev;		/* RCU, set under rtnl_lock */
+	u8 *ring;			/* vmalloc_user(), RX then TX ring */
+
+	spinlock_t lock;		/* RX ring producers */
+	unsigned int rx_head;		/* next RX slot the hardware fills */
+	struct mutex rmutex;		/* read() */
+	unsigned int rx_tail;		/* next RX slot read() takes */
+	wait_queue_head_t wait;
+
+	struct mutex wmutex;		/* write(), MYETH_TAP_KICK */
+	unsigned int tx_tail;		/* next TX slot MYETH_TAP_KICK sends */
+	u8 *bounce;			/* MYETH_TAP_BATCH bytes */
+};
+
+/* State of a batch of frames going into the interface's RX ring. */
+struct myeth_tap_rx {
+	struct net_device *dev;
+	int batch;			/* frames since NAPI last ran */
+	int sent;
+};
+
+static dev_t myeth_tap_devno;
+static struct cdev myeth_tap_cdev;
+static struct class *myeth_tap_class;
+
+static inline struct myeth_tap_slot *myeth_tap_slot(struct myeth_tap *tap,
+		int ring, unsigned int i)
+{
+	return (struct myeth_tap_slot *)(tap->ring +
+			ring * MYETH_TAP_RING_SIZE +
+			(i & (MYETH_TAP_SLOTS - 1)) * MYETH_TAP_SLOT_SIZE);
+}
+
+/* The slot holds a frame; len and the frame can be read after this. */
+static inline int myeth_tap_slot_ready(struct myeth_tap_slot *slot)
+{
+	if (ACCESS_ONCE(slot->status) != MYETH_TAP_READY)
+		return 0;
+	smp_rmb();
+	return 1;
+}
+
+/* Done with the frame in the slot, give it back to its producer. */
+static inline void myeth_tap_slot_free(struct myeth_tap_slot *slot)
+{
+	smp_mb();
+	ACCESS_ONCE(slot->status) = MYETH_TAP_FREE;
+}
+
+/*
+ * Called by the hardware, in softirq context under rcu_read_lock, for each
+ * frame transmitted on the attached interface. A full ring drops the frame
+ * as a NIC would.
+ */
+int myeth_tap_xmit(struct myeth_tap *tap, const void *data, unsigned int len)
+{
+	struct myeth_tap_slot *slot;
+	int ret = 0;
+
+	if (len > MYETH_TAP_MAX_FRAME)
+		return -EMSGSIZE;
+
+	spin_lock(&tap->lock);
+	slot = myeth_tap_slot(tap, MYETH_TAP_RX, tap->rx_head);
+	if (ACCESS_ONCE(slot->status) != MYETH_TAP_FREE) {
+		ret = -ENOBUFS;
+		goto out;
+	}
+	smp_mb(); /* user space is done with the slot */
+
+	memcpy(slot + 1, data, len);
+	slot->len = len;
+	smp_wmb(); /* frame and length before the status */
+	ACCESS_ONCE(slot->status) = MYETH_TAP_READY;
+	tap->rx_head++;
+out:
+	spin_unlock(&tap->lock);
+	return ret;
+}
+
+/* End of a burst of myeth_tap_xmit(). */
+void myeth_tap_wake(struct myeth_tap *tap)
+{
+	wake_up_interruptible(&tap->wait);
+}
+
+/*
+ * Frames from user space are received as the peer's would be, through
+ * myeth_hw_rx(). NAPI gets to run every MYETH_NAPI_WEIGHT frames, so a
+ * large batch refills the RX ring instead of overflowing it.
+ */
+static int myeth_tap_rx_begin(struct myeth_tap *tap, struct myeth_tap_rx *rx)
+{
+	struct myeth_priv *priv;
+
+	rcu_read_lock();
+	rx->dev = rcu_dereference(tap->dev);
+	if (rx->dev == NULL) {
+		rcu_read_unlock();
+		return -ENXIO;
+	}
+
+	priv = netdev_priv(rx->dev);
+	rx->batch = 0;
+	rx->sent = 0;
+	spin_lock_bh(&priv->rx_lock);
+	return 0;
+}
+
+static void myeth_tap_rx_end(struct myeth_tap_rx *rx)
+{
+	struct myeth_priv *priv = netdev_priv(rx->dev);
+
+	/* Raise the RX "interrupt"; NAPI runs on the unlock. */
+	if (rx->batch)
+		napi_schedule(&priv->napi);
+	spin_unlock_bh(&priv->rx_lock);
+	rcu_read_unlock();
+}
+
+static int myeth_tap_rx_frame(struct myeth_tap_rx *rx, const void *data,
+		unsigned int len)
+{
+	struct myeth_priv *priv = netdev_priv(rx->dev);
+	u64 now = 0;
+	int ret;
+
+	ret = myeth_hw_rx(rx->dev, data, len, &now);
+	if (ret == -ENETDOWN)
+		return ret;
+
+	/* Frames the RX ring had no room for are counted by myeth_hw_rx(). */
+	if (ret == 0)
+		rx->sent++;
+	if (++rx->batch == MYETH_NAPI_WEIGHT) {
+		napi_schedule(&priv->napi);
+		spin_unlock_bh(&priv->rx_lock);
+		spin_lock_bh(&priv->rx_lock);
+		rx->batch = 0;
+	}
+	return 0;
+}
+
+/* Binds the file to the myeth interface ifname. */
+static int myeth_tap_attach(struct myeth_tap *tap, const char *ifname)
+{
+	struct net_device *dev;
+	struct myeth_priv *priv;
+	int ret = 0;
+
+	/* The file sees and forges all traffic of the interface, as with tun. */
+	if (!capable(CAP_NET_ADMIN))
+		return -EPERM;
+
+	rtnl_lock();
+	if (tap->dev) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	dev = __dev_get_by_name(current->nsproxy->net_ns, ifname);
+	if (dev == NULL) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (!myeth_dev_is_myeth(dev)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	priv = netdev_priv(dev);
+	if (priv->tap) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	dev_hold(dev);
+	rcu_assign_pointer(tap->dev, dev);
+	rcu_assign_pointer(priv->tap, tap);
+	if (netif_running(dev))
+		netif_carrier_on(dev);
+	info("%s attached to %s", MYETH_TAP_NAME, dev->name);
+out:
+	rtnl_unlock();
+	return ret;
+}
+
+/* Called under rtnl_lock. */
+static void myeth_tap_detach(struct myeth_tap *tap)
+{
+	struct net_device *dev = tap->dev;
+	struct myeth_priv *priv;
+
+	if (dev == NULL)
+		return;
+
+	priv = netdev_priv(dev);
+	rcu_assign_pointer(priv->tap, NULL);
+	rcu_assign_pointer(tap->dev, NULL);
+	/* Neither the hardware nor a writer is using the other side now. */
+	synchronize_net();
+
+	if (!(priv->peer && (priv->peer->flags & IFF_UP)))
+		netif_carrier_off(dev);
+	info("%s detached from %s", MYETH_TAP_NAME, dev->name);
+	dev_put(dev);
+
+	/* Readers see the end of the link. */
+	wake_up_interruptible(&tap->wait);
+}
+
+/* The interface is going away, from the netdevice notifier. */
+void myeth_tap_unregister(struct net_device *dev)
+{
+	struct myeth_priv *priv = netdev_priv(dev);
+
+	if (priv->tap)
+		myeth_tap_detach(priv->tap);
+}
+
+static int myeth_tap_open(struct inode *inode, struct file *filp)
+{
+	struct myeth_tap *tap;
+
+	entry_info();
+	tap = kzalloc(sizeof(struct myeth_tap), GFP_KERNEL);
+	if (NULL == tap)
+		goto out;
+
+	/* Zeroed, so every slot starts MYETH_TAP_FREE. */
+	tap->ring = vmalloc_user(MYETH_TAP_MMAP_SIZE);
+	if (NULL == tap->ring)
+		goto free_tap;
+
+	tap->bounce = vmalloc(MYETH_TAP_BATCH);
+	if (NULL == tap->bounce)
+		goto free_ring;
+
+	spin_lock_init(&tap->lock);
+	mutex_init(&tap->rmutex);
+	mutex_init(&tap->wmutex);
+	init_waitqueue_head(&tap->wait);
+	filp->private_data = tap;
+	exit_info();
+	return 0;
+
+free_ring:
+	vfree(tap->ring);
+free_tap:
+	kfree(tap);
+out:
+	err("Couldn't allocate %s", MYETH_TAP_NAME);
+	exit_info();
+	return -ENOMEM;
+}
+
+static int myeth_tap_release(struct inode *inode, struct file *filp)
+{
+	struct myeth_tap *tap = filp->private_data;
+
+	entry_info();
+	rtnl_lock();
+	myeth_tap_detach(tap);
+	rtnl_unlock();
+
+	vfree(tap->bounce);
+	vfree(tap->ring);
+	kfree(tap);
+	exit_info();
+	return 0;
+}
+
+static ssize_t myeth_tap_read(struct file *filp, char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct myeth_tap *tap = filp->private_data;
+	struct myeth_tap_slot *slot;
+	struct myeth_tap_frame frame;
+	size_t done = 0, rec;
+	ssize_t ret = 0;
+
+	if (mutex_lock_interruptible(&tap->rmutex))
+		return -ERESTARTSYS;
+
+	slot = myeth_tap_slot(tap, MYETH_TAP_RX, tap->rx_tail);
+	while (!myeth_tap_slot_ready(slot)) {
+		if (ACCESS_ONCE(tap->dev) == NULL) {
+			ret = -ENXIO;
+			goto out;
+		}
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		mutex_unlock(&tap->rmutex);
+		if (wait_event_interruptible(tap->wait,
+					myeth_tap_slot_ready(slot) ||
+					ACCESS_ONCE(tap->dev) == NULL))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&tap->rmutex))
+			return -ERESTARTSYS;
+		slot = myeth_tap_slot(tap, MYETH_TAP_RX, tap->rx_tail);
+	}
+
+	/* As many frames as are queued and fit in the buffer. */
+	do {
+		/* Shared with user space, which may have scribbled on it. */
+		frame.len = min_t(u32, ACCESS_ONCE(slot->len),
+				MYETH_TAP_MAX_FRAME);
+		rec = MYETH_TAP_ALIGN(sizeof(frame) + frame.len);
+		if (rec > count - done) {
+			if (done == 0)
+				ret = -EINVAL;
+			break;
+		}
+
+		if (copy_to_user(buf + done, &frame, sizeof(frame)) ||
+				copy_to_user(buf + done + sizeof(frame),
+					slot + 1, frame.len)) {
+			/* The frame stays queued. */
+			if (done == 0)
+				ret = -EFAULT;
+			break;
+		}
+
+		myeth_tap_slot_free(slot);
+		tap->rx_tail++;
+		done += rec;
+		slot = myeth_tap_slot(tap, MYETH_TAP_RX, tap->rx_tail);
+	} while (myeth_tap_slot_ready(slot));
+
+	if (done)
+		ret = done;
+out:
+	mutex_unlock(&tap->rmutex);
+	return ret;
+}
+
+/*
+ * Sends the records in the bounce buffer, up to len bytes. Returns the
+ * bytes of whole records sent, which may be less than len.
+ */
+static ssize_t myeth_tap_write_batch(struct myeth_tap *tap, size_t len)
+{
+	struct myeth_tap_frame *frame;
+	struct myeth_tap_rx rx;
+	size_t off = 0, rec;
+	int ret;
+
+	ret = myeth_tap_rx_begin(tap, &rx);
+	if (ret < 0)
+		return ret;
+
+	while (len - off >= sizeof(*frame)) {
+		frame = (struct myeth_tap_frame *)(tap->bounce + off);
+		if (frame->len < ETH_HLEN || frame->len > MYETH_TAP_MAX_FRAME) {
+			ret = -EINVAL;
+			break;
+		}
+		if (frame->len > len - off - sizeof(*frame))
+			break; /* continues in the next batch */
+
+		ret = myeth_tap_rx_frame(&rx, frame + 1, frame->len);
+		if (ret < 0)
+			break;
+
+		rec = MYETH_TAP_ALIGN(sizeof(*frame) + frame->len);
+		off += min(rec, len - off);
+	}
+
+	myeth_tap_rx_end(&rx);
+	return off ? off : ret;
+}
+
+static ssize_t myeth_tap_write(struct file *filp, const char __user *buf,
+		size_t count, loff_t *f_pos)
+{
+	struct myeth_tap *tap = filp->private_data;
+	size_t done = 0, len;
+	ssize_t ret = 0;
+
+	if (mutex_lock_interruptible(&tap->wmutex))
+		return -ERESTARTSYS;
+
+	while (done < count) {
+		len = min_t(size_t, count - done, MYETH_TAP_BATCH);
+		if (copy_from_user(tap->bounce, buf + done, len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = myeth_tap_write_batch(tap, len);
+		if (ret <= 0) {
+			/* A record that is cut short by the end of the buffer. */
+			if (ret == 0)
+				ret = -EINVAL;
+			break;
+		}
+		done += ret;
+	}
+
+	mutex_unlock(&tap->wmutex);
+	return done ? done : ret;
+}
+
+/* Sends the filled slots of the TX ring, returns how many were received. */
+static int myeth_tap_kick(struct myeth_tap *tap)
+{
+	struct myeth_tap_slot *slot;
+	struct myeth_tap_rx rx;
+	unsigned int len;
+	int n, ret;
+
+	if (mutex_lock_interruptible(&tap->wmutex))
+		return -ERESTARTSYS;
+
+	ret = myeth_tap_rx_begin(tap, &rx);
+	if (ret < 0)
+		goto out;
+
+	for (n = 0; n < MYETH_TAP_SLOTS; n++) {
+		slot = myeth_tap_slot(tap, MYETH_TAP_TX, tap->tx_tail);
+		if (!myeth_tap_slot_ready(slot))
+			break;
+
+		/* User space may change it under us, read it once. */
+		len = ACCESS_ONCE(slot->len);
+		if (len >= ETH_HLEN && len <= MYETH_TAP_MAX_FRAME) {
+			ret = myeth_tap_rx_frame(&rx, slot + 1, len);
+			if (ret < 0)
+				break;
+		} else {
+			rx.dev->stats.rx_length_errors++;
+		}
+
+		myeth_tap_slot_free(slot);
+		tap->tx_tail++;
+	}
+
+	myeth_tap_rx_end(&rx);
+	if (ret == 0 || rx.sent)
+		ret = rx.sent;
+out:
+	mutex_unlock(&tap->wmutex);
+	return ret;
+}
+
+static int myeth_tap_ioctl(struct inode *inode, struct file *filp,
+		unsigned int cmd, unsigned long arg)
+{
+	struct myeth_tap *tap = filp->private_data;
+	struct myeth_tap_attach attach;
+
+	switch (cmd) {
+	case MYETH_TAP_ATTACH:
+		if (copy_from_user(&attach, (void __user *)arg, sizeof(attach)))
+			return -EFAULT;
+		attach.ifname[sizeof(attach.ifname) - 1] = '\0';
+		return myeth_tap_attach(tap, attach.ifname);
+
+	case MYETH_TAP_KICK:
+		return myeth_tap_kick(tap);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static unsigned int myeth_tap_poll(struct file *filp, poll_table *wait)
+{
+	struct myeth_tap *tap = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM; /* write() never blocks */
+
+	poll_wait(filp, &tap->wait, wait);
+
+	/* The next frame for read(), or the latest one for mmap() users. */
+	if (myeth_tap_slot_ready(myeth_tap_slot(tap, MYETH_TAP_RX, tap->rx_tail)) ||
+			myeth_tap_slot_ready(myeth_tap_slot(tap, MYETH_TAP_RX,
+					ACCESS_ONCE(tap->rx_head) - 1)))
+		mask |= POLLIN | POLLRDNORM;
+	else if (ACCESS_ONCE(tap->dev) == NULL)
+		mask |= POLLERR;
+	return mask;
+}
+
+static int myeth_tap_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct myeth_tap *tap = filp->private_data;
+
+	if (vma->vm_pgoff != 0 ||
+			vma->vm_end - vma->vm_start != MYETH_TAP_MMAP_SIZE)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, tap->ring, 0);
+}
+
+static const struct file_operations myeth_tap_fops = {
+	.owner		= THIS_MODULE,
+	.open		= myeth_tap_open,
+	.release	= myeth_tap_release,
+	.read		= myeth_tap_read,
+	.write		= myeth_tap_write,
+	.ioctl		= myeth_tap_ioctl,
+	.poll		= myeth_tap_poll,
+	.mmap		= myeth_tap_mmap,
+};
+
+int myeth_tap_init(void)
+{
+	struct device *device;
+	int ret;
+
+	entry_info();
+	ret = alloc_chrdev_region(&myeth_tap_devno, 0, 1, MYETH_TAP_NAME);
+	if (ret < 0) {
+		err("%s registering failed with %d", MYETH_TAP_NAME, ret);
+		goto out;
+	}
+
+	myeth_tap_class = class_create(THIS_MODULE, MYETH_TAP_NAME);
+	if (IS_ERR(myeth_tap_class)) {
+		ret = PTR_ERR(myeth_tap_class);
+		goto unregister_chrdev;
+	}
+
+	cdev_init(&myeth_tap_cdev, &myeth_tap_fops);
+	myeth_tap_cdev.owner = THIS_MODULE;
+	ret = cdev_add(&myeth_tap_cdev, myeth_tap_devno, 1);
+	if (ret < 0) {
+		err("Failed to add %s", MYETH_TAP_NAME);
+		goto destroy_class;
+	}
+
+	device = device_create(myeth_tap_class, NULL, myeth_tap_devno, NULL,
+			"%s", MYETH_TAP_NAME);
+	if (IS_ERR(device)) {
+		ret = PTR_ERR(device);
+		goto del_cdev;
+	}
+
+	exit_info();
+	return 0;
+
+del_cdev:
+	cdev_del(&myeth_tap_cdev);
+destroy_class:
+	class_destroy(myeth_tap_class);
+unregister_chrdev:
+	unregister_chrdev_region(myeth_tap_devno, 1);
+out:
+	exit_info();
+	return ret;
+}
+
+void myeth_tap_exit(void)
+{
+	entry_info();
+	device_destroy(myeth_tap_class, myeth_tap_devno);
+	cdev_del(&myeth_tap_cdev);
+	class_destroy(myeth_tap_class);
+	unregister_chrdev_region(myeth_tap_devno, 1);
+	exit_info();
+}